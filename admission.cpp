@@ -0,0 +1,127 @@
+#include "admission.h"
+
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+const char* routeNames[AdmissionController::ROUTE_COUNT] = {
+    "create",
+    "update",
+    "visits",
+    "avg"
+};
+
+// weight of a new sample in the moving average is 1/2^EWMA_SHIFT
+const int EWMA_SHIFT = 3;
+
+void addSample(std::atomic<uint32_t>& average, int64_t sample)
+{
+    // concurrent updates may drop a sample, the average doesn't mind
+    int64_t old = average.load(std::memory_order_relaxed);
+    int64_t updated = old + ((sample - old) >> EWMA_SHIFT);
+    if (updated == old && sample > old)
+        ++updated;
+    average.store(uint32_t(updated > 0 ? updated : 0), std::memory_order_relaxed);
+}
+
+} // namespace
+
+void AdmissionController::setLimits(const AdmissionLimits& limits)
+{
+    d_limits = limits;
+}
+
+uint64_t AdmissionController::clockUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool AdmissionController::admit(Route route, Ticket& ticket, uint64_t receivedUs)
+{
+    if (!enabled())
+        return true;
+
+    uint64_t now = clockUs();
+    int64_t queued = receivedUs && receivedUs < now ? now - receivedUs : 0;
+    addSample(d_queueUs, queued);
+
+    // it already waited too long to be worth an answer
+    if (d_limits.maxQueueUs > 0 && queued > d_limits.maxQueueUs) {
+        d_shed[route].fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint32_t estimate = d_estimateUs[route].load(std::memory_order_relaxed);
+
+    if (d_limits.maxLatencyUs > 0 && estimate > uint32_t(d_limits.maxLatencyUs)) {
+        d_estimateUs[route].store(estimate - (estimate >> EWMA_SHIFT), std::memory_order_relaxed);
+        d_shed[route].fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint32_t cost = estimate ? estimate : 1;
+    int64_t inflight = d_inflightUs.fetch_add(cost, std::memory_order_relaxed) + cost;
+
+    // a lone request always runs, however expensive it looks
+    if (d_limits.maxInflightUs > 0 && inflight > d_limits.maxInflightUs && inflight != cost) {
+        d_inflightUs.fetch_sub(cost, std::memory_order_relaxed);
+        d_shed[route].fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    d_admitted[route].fetch_add(1, std::memory_order_relaxed);
+
+    ticket.d_owner = this;
+    ticket.d_route = route;
+    ticket.d_cost = cost;
+    ticket.d_start = now - queued;
+    return true;
+}
+
+void AdmissionController::release(Ticket& ticket)
+{
+    d_inflightUs.fetch_sub(ticket.d_cost, std::memory_order_relaxed);
+
+    addSample(d_estimateUs[ticket.d_route], clockUs() - ticket.d_start);
+}
+
+uint64_t AdmissionController::admitted() const
+{
+    uint64_t total = 0;
+    for (auto& a: d_admitted)
+        total += a.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t AdmissionController::shed(Route route) const
+{
+    return d_shed[route].load(std::memory_order_relaxed);
+}
+
+std::string AdmissionController::stats() const
+{
+    std::string s;
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "{ \"inflight_us\": %lld, \"queue_us\": %u, \"routes\": {",
+            (long long)d_inflightUs.load(std::memory_order_relaxed),
+            d_queueUs.load(std::memory_order_relaxed));
+    s += buf;
+
+    for (int r = 0; r < ROUTE_COUNT; ++r) {
+        snprintf(buf, sizeof(buf),
+                "%s \"%s\": { \"admitted\": %llu, \"shed\": %llu, \"estimate_us\": %u }",
+                r ? "," : "",
+                routeNames[r],
+                (unsigned long long)d_admitted[r].load(std::memory_order_relaxed),
+                (unsigned long long)d_shed[r].load(std::memory_order_relaxed),
+                d_estimateUs[r].load(std::memory_order_relaxed));
+        s += buf;
+    }
+
+    s += " } }";
+    return s;
+}
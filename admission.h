@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+struct AdmissionLimits
+{
+    // estimated microseconds of work allowed to run at once, 0 - no limit
+    int maxInflightUs = 0;
+
+    // routes averaging more microseconds per request get shed, 0 - no limit
+    int maxLatencyUs = 0;
+
+    // requests read longer ago than this are shed, 0 - no limit
+    int maxQueueUs = 0;
+};
+
+// Sheds requests before they run instead of letting them queue up.
+// Every route keeps a moving average of its latency from the time the
+// request was read until it is done, queueing included, which is the
+// cost charged against the in-flight budget while a request executes.
+// A shed request decays its route's average, so a route shut off by the
+// latency limit lets probes through again after a while.
+class AdmissionController
+{
+public:
+
+    enum Route {
+        EntityCreate,
+        EntityUpdate,
+        Visits,
+        Average,
+        ROUTE_COUNT
+    };
+
+    // held while an admitted request runs, records its latency when done
+    class Ticket
+    {
+    public:
+
+        Ticket() {}
+        Ticket(const Ticket&) = delete;
+        Ticket& operator =(const Ticket&) = delete;
+
+        // a pipelined write hands its ticket over to the connection
+        Ticket& operator =(Ticket&& other)
+        {
+            release();
+            d_owner = other.d_owner;
+            d_route = other.d_route;
+            d_cost = other.d_cost;
+            d_start = other.d_start;
+            other.d_owner = nullptr;
+            return *this;
+        }
+
+        ~Ticket()
+        {
+            release();
+        }
+
+        // the request is done, no-op if it was never admitted
+        void release()
+        {
+            if (d_owner)
+                d_owner->release(*this);
+            d_owner = nullptr;
+        }
+
+    private:
+
+        friend class AdmissionController;
+
+        AdmissionController* d_owner = nullptr;
+        Route d_route = EntityCreate;
+        uint32_t d_cost = 0;
+        uint64_t d_start = 0;
+    };
+
+    void setLimits(const AdmissionLimits& limits);
+
+    bool enabled() const
+    {
+        return d_limits.maxInflightUs > 0 || d_limits.maxLatencyUs > 0 || d_limits.maxQueueUs > 0;
+    }
+
+    // false if the request should be answered with 503, receivedUs is
+    // when it was read, from clockUs(), 0 if unknown
+    bool admit(Route route, Ticket& ticket, uint64_t receivedUs = 0);
+
+    uint64_t admitted() const;
+    uint64_t shed(Route route) const;
+
+    // counters as a JSON object
+    std::string stats() const;
+
+    static uint64_t clockUs();
+
+private:
+
+    void release(Ticket& ticket);
+
+    AdmissionLimits d_limits;
+    std::atomic<int64_t> d_inflightUs{0};
+    // moving average of the time from read to admission
+    std::atomic<uint32_t> d_queueUs{0};
+    std::atomic<uint32_t> d_estimateUs[ROUTE_COUNT] = {};
+    std::atomic<uint64_t> d_admitted[ROUTE_COUNT] = {};
+    std::atomic<uint64_t> d_shed[ROUTE_COUNT] = {};
+};
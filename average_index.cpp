@@ -0,0 +1,166 @@
+#include "average_index.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace {
+
+bool partitionLess(const AverageIndex::Partition* p, const std::pair<char, int32_t>& key)
+{
+    return p->gender < key.first || (p->gender == key.first && p->ageKey < key.second);
+}
+
+} // namespace
+
+AverageIndex::~AverageIndex()
+{
+    // the list itself goes with d_partitions
+    if (auto parts = d_partitions.get()) {
+        for (auto p: *parts)
+            delete p;
+    }
+}
+
+void AverageIndex::build(std::vector<Sample>& samples)
+{
+    std::sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) {
+        if (a.gender != b.gender)
+            return a.gender < b.gender;
+        if (a.ageKey != b.ageKey)
+            return a.ageKey < b.ageKey;
+        return a.visited_at < b.visited_at;
+    });
+
+    std::unique_ptr<Partitions> next(new Partitions());
+    Partition* p = nullptr;
+
+    for (const auto& s: samples) {
+        if (!p || p->gender != s.gender || p->ageKey != s.ageKey) {
+            p = new Partition();
+            p->gender = s.gender;
+            p->ageKey = s.ageKey;
+            p->sums.push_back(0);
+            next->push_back(p);
+        }
+
+        p->visitedAt.push_back(s.visited_at);
+        p->sums.push_back(p->sums.back() + s.mark);
+    }
+
+    auto old = d_partitions.get();
+    d_partitions.publish(next.release());
+
+    if (old) {
+        for (auto p: *old)
+            Epoch::retire(p);
+    }
+}
+
+void AverageIndex::add(const Sample& s)
+{
+    update(s, true);
+}
+
+void AverageIndex::remove(const Sample& s)
+{
+    update(s, false);
+}
+
+void AverageIndex::update(const Sample& s, bool insert)
+{
+    auto current = d_partitions.get();
+    std::unique_ptr<Partitions> next(current ? new Partitions(*current) : new Partitions());
+
+    auto key = std::make_pair(s.gender, s.ageKey);
+    auto it = std::lower_bound(next->begin(), next->end(), key, partitionLess);
+    bool found = it != next->end() && (*it)->gender == s.gender && (*it)->ageKey == s.ageKey;
+
+    const Partition* old = found ? *it : nullptr;
+    if (!old && !insert)
+        return;
+
+    std::unique_ptr<Partition> p(old ? new Partition(*old) : new Partition());
+    if (!old) {
+        p->gender = s.gender;
+        p->ageKey = s.ageKey;
+        p->sums.push_back(0);
+    }
+
+    auto& times = p->visitedAt;
+    auto& sums = p->sums;
+
+    if (insert) {
+        size_t pos = std::upper_bound(times.begin(), times.end(), s.visited_at) - times.begin();
+        times.insert(times.begin() + pos, s.visited_at);
+        sums.insert(sums.begin() + pos + 1, sums[pos]);
+        for (size_t i = pos + 1; i < sums.size(); ++i)
+            sums[i] += s.mark;
+    } else {
+        // visits at the same time are told apart by their marks only
+        size_t pos = std::lower_bound(times.begin(), times.end(), s.visited_at) - times.begin();
+        while (pos < times.size() && times[pos] == s.visited_at && sums[pos + 1] - sums[pos] != s.mark)
+            ++pos;
+
+        if (pos == times.size() || times[pos] != s.visited_at)
+            return;
+
+        times.erase(times.begin() + pos);
+        sums.erase(sums.begin() + pos + 1);
+        for (size_t i = pos + 1; i < sums.size(); ++i)
+            sums[i] -= s.mark;
+    }
+
+    if (times.empty())
+        next->erase(it);
+    else if (old)
+        *it = p.release();
+    else
+        next->insert(it, p.release());
+
+    d_partitions.publish(next.release());
+    Epoch::retire(old);
+}
+
+void AverageIndex::query(char gender, int32_t minKey, int32_t maxKey,
+        uint32_t fromDate, uint32_t toDate,
+        uint64_t& sum, uint64_t& count) const
+{
+    sum = 0;
+    count = 0;
+
+    auto parts = d_partitions.get();
+    if (!parts)
+        return;
+
+    auto end = parts->end();
+    auto it = parts->begin();
+
+    // each gender is a run of partitions ordered by age key, only the
+    // ones inside [minKey, maxKey] are touched
+    while (it != end) {
+        char g = gender ? gender : (*it)->gender;
+        it = std::lower_bound(it, end, std::make_pair(g, minKey), partitionLess);
+
+        for (; it != end && (*it)->gender == g && (*it)->ageKey <= maxKey; ++it) {
+            const Partition& p = **it;
+
+            size_t from = 0;
+            size_t to = p.visitedAt.size();
+
+            if (fromDate)
+                from = std::lower_bound(p.visitedAt.begin(), p.visitedAt.end(), fromDate) - p.visitedAt.begin();
+            if (toDate)
+                to = std::upper_bound(p.visitedAt.begin(), p.visitedAt.end(), toDate) - p.visitedAt.begin();
+
+            if (from < to) {
+                sum += p.sums[to] - p.sums[from];
+                count += to - from;
+            }
+        }
+
+        if (gender)
+            break;
+
+        it = std::partition_point(it, end, [g](const Partition* p) { return p->gender == g; });
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "epoch.h"
+
+// Marks of a location's visits grouped by user gender and age key, each
+// group ordered by visited_at with running sums, so an avg query costs
+// two binary searches per group instead of a walk over every visit.
+// Published copy on write like OrderedVisits, an update copies the
+// group list and the one group it changes.
+//
+// Neither side is logarithmic overall: a query visits every group in
+// its age range, two per year of age for each gender, and an update is
+// linear in the size of the group it copies.
+class AverageIndex
+{
+public:
+
+    // locations with fewer visits are cheaper to scan
+    static const std::size_t HOT_VISITS = 256;
+
+    struct Sample
+    {
+        char gender;
+        int32_t ageKey;
+        uint32_t visited_at;
+        uint8_t mark;
+    };
+
+    struct Partition
+    {
+        char gender;
+        int32_t ageKey;
+        std::vector<uint32_t> visitedAt;
+        // sums[i] is the sum of the first i marks
+        std::vector<uint32_t> sums;
+    };
+
+    typedef std::vector<const Partition*> Partitions;
+
+    AverageIndex() {}
+    ~AverageIndex();
+
+    bool built() const
+    {
+        return d_partitions.get() != nullptr;
+    }
+
+    void build(std::vector<Sample>& samples);
+
+    void add(const Sample& s);
+    void remove(const Sample& s);
+
+    // marks of visits with visited_at in [fromDate, toDate] and age key
+    // in [minKey, maxKey], dates of 0 are unbounded, gender 0 matches all
+    void query(char gender, int32_t minKey, int32_t maxKey,
+            uint32_t fromDate, uint32_t toDate,
+            uint64_t& sum, uint64_t& count) const;
+
+private:
+
+    void update(const Sample& s, bool insert);
+
+    // sorted by (gender, ageKey)
+    Versioned<Partitions> d_partitions;
+};
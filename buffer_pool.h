@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Per-thread cache of fixed size buffers. A buffer may be released by
+// another thread than the one that acquired it, it then simply moves
+// to that thread's cache. Each thread keeps at most MAX_CACHED buffers.
+template <size_t Size>
+class BufferPool
+{
+public:
+
+    static const size_t MAX_CACHED = 64;
+
+    static char* acquire()
+    {
+        auto& cache = local();
+        if (cache.empty())
+            return new char[Size];
+
+        char* p = cache.back();
+        cache.pop_back();
+        return p;
+    }
+
+    static void release(char* p)
+    {
+        auto& cache = local();
+        if (cache.size() >= MAX_CACHED) {
+            delete[] p;
+            return;
+        }
+
+        cache.push_back(p);
+    }
+
+private:
+
+    struct Cache
+    {
+        std::vector<char*> buffers;
+
+        ~Cache()
+        {
+            for (auto p: buffers)
+                delete[] p;
+        }
+    };
+
+    static std::vector<char*>& local()
+    {
+        static thread_local Cache cache;
+        return cache.buffers;
+    }
+};
+
+// Buffer borrowed from BufferPool on first use,
+// owners give it back once the data is no longer needed.
+template <size_t Size>
+class PooledBuffer
+{
+public:
+
+    PooledBuffer() {}
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator =(const PooledBuffer&) = delete;
+
+    ~PooledBuffer()
+    {
+        release();
+    }
+
+    char* data()
+    {
+        if (!d_ptr)
+            d_ptr = BufferPool<Size>::acquire();
+        return d_ptr;
+    }
+
+    constexpr size_t size() const
+    {
+        return Size;
+    }
+
+    bool attached() const
+    {
+        return d_ptr != nullptr;
+    }
+
+    bool contains(const char* p) const
+    {
+        return d_ptr && p >= d_ptr && p < d_ptr + Size;
+    }
+
+    void release()
+    {
+        if (d_ptr) {
+            BufferPool<Size>::release(d_ptr);
+            d_ptr = nullptr;
+        }
+    }
+
+private:
+
+    char* d_ptr = nullptr;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include <boost/utility/string_ref.hpp>
+
+const boost::string_ref HTTP_CONNECTION_KEEP_ALIVE("Connection: keep-alive\r\n");
+const boost::string_ref HTTP_CONNECTION_CLOSE("Connection: close\r\n");
+
+// Complete HTTP response rendered once per entity version.
+// The Connection header is not part of it: the connection sends it as
+// a separate iovec, so one copy serves keep-alive and close clients.
+class CachedResponse
+{
+public:
+
+    void render(boost::string_ref body,
+            boost::string_ref statusLine = "HTTP/1.1 200 OK\r\n",
+            boost::string_ref contentType = "application/json; charset=UTF-8")
+    {
+        char headers[256];
+        int len = snprintf(headers, sizeof(headers),
+            "%.*s"
+            "Content-Length: %zu\r\n"
+            "Content-Type: %.*s\r\n",
+            int(statusLine.size()), statusLine.data(),
+            body.size(),
+            int(contentType.size()), contentType.data());
+
+        d_headersSize = len;
+        d_size = len + 2 + body.size();
+        d_data.reset(new char[d_size]);
+
+        char* p = d_data.get();
+        memcpy(p, headers, len);
+        memcpy(p + len, "\r\n", 2);
+        if (!body.empty())
+            memcpy(p + len + 2, body.data(), body.size());
+    }
+
+    bool empty() const
+    {
+        return !d_data;
+    }
+
+    // status line, Content-Length and Content-Type
+    boost::string_ref headers() const
+    {
+        return boost::string_ref(d_data.get(), d_headersSize);
+    }
+
+    // blank line and body
+    boost::string_ref tail() const
+    {
+        return boost::string_ref(d_data.get() + d_headersSize, d_size - d_headersSize);
+    }
+
+    boost::string_ref body() const
+    {
+        return boost::string_ref(d_data.get() + d_headersSize + 2, d_size - d_headersSize - 2);
+    }
+
+private:
+
+    std::unique_ptr<char[]> d_data;
+    uint32_t d_headersSize = 0;
+    uint32_t d_size = 0;
+};
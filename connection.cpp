@@ -1,5 +1,7 @@
 #include "connection.h"
 
+thread_local phr_header HttpParser::headers[100];
+
 namespace StatusStrings {
 
     const std::string ok =
@@ -77,10 +79,40 @@ namespace StatusStrings {
 
 } // namespace status_strings
 
+namespace {
+
+CachedResponse renderEmpty(HttpStatus status)
+{
+    CachedResponse r;
+    r.render(boost::string_ref(), StatusStrings::toStringRef(status), "application/octet-stream");
+    return r;
+}
+
+} // namespace
+
+const CachedResponse* prerenderedResponse(HttpStatus status)
+{
+    static const CachedResponse bad_request = renderEmpty(HttpStatus::bad_request);
+    static const CachedResponse not_found = renderEmpty(HttpStatus::not_found);
+    static const CachedResponse service_unavailable = renderEmpty(HttpStatus::service_unavailable);
+
+    switch (status) {
+    case HttpStatus::bad_request:
+        return &bad_request;
+    case HttpStatus::not_found:
+        return &not_found;
+    case HttpStatus::service_unavailable:
+        return &service_unavailable;
+    default:
+        return nullptr;
+    }
+}
+
 
 void ConnectionBase::formatHeaders(const Response& response)
 {
-    int len = snprintf(d_headersBuf.data(), d_headersBuf.size(),
+    char* p = d_outBuf.data() + d_outUsed;
+    int len = snprintf(p, d_outBuf.size() - d_outUsed,
         "%s"
         "Content-Length: %zu\r\n"
         "Connection: %s\r\n"
@@ -92,6 +124,7 @@ void ConnectionBase::formatHeaders(const Response& response)
         keepAlive ? "keep-alive" : "close",
         response.contentType.data());
 
-    d_headersRef = boost::string_ref(d_headersBuf.data(), len);
+    d_headersRef = boost::string_ref(p, len);
+    d_outUsed += len;
 }
 
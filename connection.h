@@ -2,9 +2,15 @@
 
 #include <rapidjson/stringbuffer.h>
 
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <cstring>
 #include <iostream>
-#include <http_parser.h>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+#include "epoch.h"
 #include "picohttpparser.h"
 #include "handler.h"
 
@@ -28,12 +34,17 @@ class HttpParser {
 public:
     boost::string_ref methodRef, pathRef;
     int minor_version;
-    phr_header headers[100];
+    // only looked at right after parsing, no need to keep it per connection
+    static thread_local phr_header headers[100];
     size_t headerscount = 0;
 
+    // returns the number of bytes of buf taken by the header,
+    // -2 if the header is incomplete (buf is kept), -1 on error
     int parseRequest(const char* buf, size_t buflen)
     {
-        if (!d_stored.empty()) {
+        size_t stored = d_stored.size();
+
+        if (stored) {
             d_stored.append(buf, buflen);
             buf = d_stored.data();
             buflen = d_stored.length();
@@ -48,7 +59,7 @@ public:
         // incomplete
         if (res == -2) {
             // remember incomplete part
-            if (d_stored.empty()) {
+            if (!stored) {
                 d_stored.assign(buf, buflen);
             }
         }
@@ -59,8 +70,20 @@ public:
         headerscount = numhdr;
         methodRef = boost::string_ref(method, method_len);
         pathRef = boost::string_ref(path, path_len);
+        return res - stored;
+    }
+
+    // header was assembled from several reads
+    bool stored() const
+    {
+        return !d_stored.empty();
+    }
+
+    // refs above may point into the stored part, 
+    // so it lives until the request is done
+    void reset()
+    {
         d_stored.clear();
-        return res;
     }
 
 private:
@@ -68,7 +91,14 @@ private:
     std::string d_stored;
 };
 
-const size_t CONN_BUF_SIZE = 0xffff; // 64k
+const size_t READ_BUF_SIZE = 8192;
+const size_t OUT_BUF_SIZE = 4096*4;
+const size_t MAX_WRITE_BUFS = 32;
+static_assert(MAX_WRITE_BUFS <= 32, "transient write buffers are tracked in a 32 bit mask");
+const size_t HEADERS_RESERVE = 256;
+
+// bodyless responses rendered once, nullptr for other statuses
+const CachedResponse* prerenderedResponse(HttpStatus status);
 const ssize_t UV_EOF = -1;
 
 struct uv_buf_t {
@@ -91,23 +121,52 @@ public:
     {
         // frintf(stderr, "onRead (responseSent=%d)\n", responseSent);
 
+        // responses may point into entity versions until they are sent
+        EpochGuard guard;
+
         if (nread == UV_EOF) {
             onMessageComplete();
         } else {
             if (nread == 0) {
                 close();
+                return;
             } else {
-                int ret = handleData(nread, buf);
-                if (ret != 0) {
-                    writeResponse(ret);
-                }
+                d_inputUs = AdmissionController::clockUs();
+                handleInput(buf->base, nread);
             }
         }
+
+        if (writeIoCount > 0) {
+            flushResponses();
+            stabilizeWrites();
+        }
+    }
+
+    // Handles every complete request in the buffer and queues the responses, 
+    // the caller flushes them with a single write. Input that does not fit 
+    // into the output buffers waits until the queued responses are sent.
+    void handleInput(const char* data, size_t len)
+    {
+        while (len > 0 && !d_closeAfterWrite) {
+            if (d_writePending || (!headerDone && !canQueueResponse())) {
+                if (d_pending.empty())
+                    d_pendingUs = d_inputUs;
+                d_pending.append(data, len);
+                return;
+            }
+
+            ssize_t used = handleData(data, len);
+            if (used < 0)
+                return;
+
+            data += used;
+            len -= used;
+        }
     }
 
     int processHeaders()
     {
-        if (onUrl(reqParser.pathRef.data(), reqParser.pathRef.length()) != 0) {
+        if (onUrl(reqParser.pathRef) != 0) {
             return 400;
         }
 
@@ -121,6 +180,8 @@ public:
         if (reqParser.minor_version == 1)
             keepAlive = true;
 
+        ++d_requests;
+
         for (size_t i = 0; i < reqParser.headerscount; ++i) {
             const auto& field = reqParser.headers[i];
             const boost::string_ref name(field.name, field.name_len);
@@ -137,74 +198,121 @@ public:
             }
         }
 
+        if (d_maxRequests && d_requests >= d_maxRequests)
+            keepAlive = false;
+
         return 0;
     }
 
-    int handleData(ssize_t nread, const uv_buf_t * buf)
+    // something has been received or is waiting to be written
+    bool requestInProgress() const
+    {
+        return headerDone || reqParser.stored() || writeIoCount > 0 || d_writePending;
+    }
+
+    // returns number of bytes used, -1 if the connection can't go on
+    ssize_t handleData(const char* pbuf, size_t nread)
     {
-        const char* pbuf = buf->base;
+        size_t used = 0;
 
         if (!headerDone) {
-            int pr = reqParser.parseRequest(buf->base, nread);
-            if (pr > 0) {
+            int pr = reqParser.parseRequest(pbuf, nread);
+            if (pr >= 0) {
                 headerDone = true;
 
                 int res = processHeaders();
-                if (res != 0)
-                    return res;
+                if (res != 0) {
+                    failRequest(res);
+                    return -1;
+                }
 
                 // advance data pointer
-                nread -= pr;
-                pbuf += pr;
+                used = pr;
 
             } else if (pr == -1) {
-                std::cerr << "Header parse error, hdr = \n" << boost::string_ref(buf->base, nread) << std::endl;
-                return 400;
+                std::cerr << "Header parse error, hdr = \n" << boost::string_ref(pbuf, nread) << std::endl;
+                failRequest(400);
+                return -1;
+            } else {
+                return nread;
             }
         }
 
-        // check if some extra shit is there
-        if (d_dataRead + nread > d_contentLength) {
-            nread = d_contentLength - d_dataRead;
-        }
+        // anything past the body belongs to the next request
+        size_t take = std::min(nread - used, d_contentLength - d_dataRead);
 
-        onBody(pbuf, nread);
-        d_dataRead += nread;
+        onBody(pbuf + used, take);
+        d_dataRead += take;
+        used += take;
 
         if (d_contentLength == d_dataRead)
             onMessageComplete();
+        else
+            keepRequestHead();
 
-        return 0;
+        return used;
     }
 
     int onMessageComplete()
     {
         // fprintf(stderr, "onMessageComplete (responseSent=%d)\n", responseSent);
 
-        int result = d_handler.handle(method, body, path, query, d_response);
+        // the previous response may still sit in d_response
+        detachResponseBody();
+        d_response.clear();
+
+        int result = d_handler.handle(method, body, path, query, d_response, writeCompletion(), d_inputUs);
+
+        // the writer thread has it, input waits until its status is back
+        if (result == Handler::PENDING) {
+            d_writePending = true;
+            d_pendingKeepAlive = keepAlive;
+            resetRequest();
+            return 0;
+        }
+
         if (result == 200)
             d_response.setContentJson();
 
-        writeResponse(result);
+        queueResponse(result);
+        resetRequest();
         return 0;
     }
 
-    int onUrl(const char *at, size_t length)
+    // stops the pipeline: nothing after a broken request can be trusted
+    void failRequest(int status)
     {
-        http_parser_url url;
-        if (http_parser_parse_url(at, length, false, &url)) {
-            std::cout << "Failed to parse url: " << std::string(at, length) << std::endl;
-            return 1;
-        }
+        detachResponseBody();
+        d_response.clear();
+        keepAlive = false;
+        queueResponse(status);
+    }
 
-        if (url.field_set & (1 << UF_PATH)) {
-            path.assign(at + url.field_data[UF_PATH].off, url.field_data[UF_PATH].len);
-        }
+    // path and query are views into the request target
+    int onUrl(boost::string_ref url)
+    {
+        // absolute form: skip scheme and authority
+        if (!url.starts_with('/')) {
+            size_t p = url.find("://");
+            if (p != boost::string_ref::npos) {
+                url.remove_prefix(p + 3);
+                p = url.find('/');
+            }
 
-        if (url.field_set & (1 << UF_QUERY)) {
-            query.assign(at + url.field_data[UF_QUERY].off, url.field_data[UF_QUERY].len);
+            if (p == boost::string_ref::npos) {
+                std::cout << "Failed to parse url: " << url << std::endl;
+                return 1;
+            }
+
+            url.remove_prefix(p);
         }
 
+        url = url.substr(0, url.find('#'));
+
+        size_t q = url.find('?');
+        path = url.substr(0, q);
+        query = q == boost::string_ref::npos ? boost::string_ref() : url.substr(q + 1);
+
         // fprintf(stderr, "Path: %s, query: %s\n", path.c_str(), query.c_str());
 
         return 0;
@@ -212,38 +320,237 @@ public:
 
     int onBody(const char *at, size_t length)
     {
-        body.append(at, length);
+        // a body that came in one piece is used in place
+        if (d_dataRead == 0 && length == d_contentLength) {
+            body = boost::string_ref(at, length);
+            return 0;
+        }
+
+        d_body.append(at, length);
+        body = d_body;
         return 0;
     }
 
+    // The request goes on in the next read, which will overwrite the buffer
+    // path and query point to. A header assembled by the parser is safe.
+    void keepRequestHead()
+    {
+        if (reqParser.stored() || path.data() == d_url.data())
+            return;
+
+        d_url.assign(path.data(), path.size());
+        d_url += '?';
+        d_url.append(query.data(), query.size());
+
+        path = boost::string_ref(d_url.data(), path.size());
+        query = boost::string_ref(d_url.data() + path.size() + 1, query.size());
+    }
+
     int onWriteComplete()
     {
-        if (!keepAlive) {
+        writeIndex = 0;
+        writeIoCount = 0;
+        d_transientBufs = 0;
+        d_stable.clear();
+        d_outUsed = 0;
+        d_outBuf.release();
+        d_bodyBuf = MAX_WRITE_BUFS;
+
+        if (d_closeAfterWrite) {
             close();
             return 0;
         }
 
+        // clear response
+        d_response.clear();
+
+        // onWriteApplied() goes on with the input
+        if (d_writePending)
+            return 0;
+
+        if (!d_pending.empty()) {
+            EpochGuard guard;
+
+            std::string pending;
+            pending.swap(d_pending);
+            d_inputUs = d_pendingUs;
+            handleInput(pending.data(), pending.size());
+
+            if (writeIoCount > 0) {
+                flushResponses();
+                stabilizeWrites();
+                return 0;
+            }
+        }
+
+        startRead();
+
+        return 0;
+    }
+
+    void resetRequest()
+    {
+        reqParser.reset();
         headerDone = false;
         keepAlive = false;
 
         path.clear();
         query.clear();
         body.clear();
+        d_url.clear();
+        d_body.clear();
         d_dataRead = 0;
         d_contentLength = 0;
+    }
 
-        // clear response
-        d_response.clear();
+    void formatHeaders(const Response& response);
 
-        startRead();
+    void addWriteBuf(const void* data, size_t size, bool transient = false)
+    {
+        if (size == 0)
+            return;
+
+        size_t idx = writeIndex + writeIoCount;
+        assert(idx < writeBufs.size());
+        writeBufs[idx].iov_base = (void*)data;
+        writeBufs[idx].iov_len = size;
+        if (transient)
+            d_transientBufs |= 1u << idx;
+        ++writeIoCount;
+    }
 
-        return 0;
+    // The write did not finish inside the reader epoch, so entity
+    // versions it points to may be reclaimed. Copies them out.
+    void stabilizeWrites()
+    {
+        if (writeIoCount == 0 || !d_transientBufs)
+            return;
+
+        size_t total = 0;
+        for (size_t i = writeIndex; i < writeIndex + writeIoCount; ++i) {
+            if (d_transientBufs & (1u << i))
+                total += writeBufs[i].iov_len;
+        }
+
+        std::unique_ptr<char[]> copy(new char[total]);
+        char* p = copy.get();
+
+        for (size_t i = writeIndex; i < writeIndex + writeIoCount; ++i) {
+            if (d_transientBufs & (1u << i)) {
+                memcpy(p, writeBufs[i].iov_base, writeBufs[i].iov_len);
+                writeBufs[i].iov_base = p;
+                p += writeBufs[i].iov_len;
+            }
+        }
+
+        d_transientBufs = 0;
+        d_stable.push_back(std::move(copy));
     }
 
-    void formatHeaders(const Response& response);
+    // drops the first n queued bytes after a (partial) write
+    void consumeWritten(size_t n)
+    {
+        while (n > 0 && writeIoCount > 0) {
+            auto& iov = writeBufs[writeIndex];
+
+            if (iov.iov_len > n) {
+                iov.iov_len -= n;
+                iov.iov_base = (char*)iov.iov_base + n;
+                break;
+            }
+
+            n -= iov.iov_len;
+            ++writeIndex;
+            --writeIoCount;
+        }
+    }
+
+    bool canQueueResponse() const
+    {
+        size_t pendingBody = d_bodyBuf < MAX_WRITE_BUFS ? writeBufs[d_bodyBuf].iov_len : 0;
+
+        return writeIndex + writeIoCount + 3 <= writeBufs.size() &&
+            d_outUsed + pendingBody + HEADERS_RESERVE <= d_outBuf.size();
+    }
+
+    void queueResponse(int status)
+    {
+        d_response.code = static_cast<HttpStatus>(status);
+        if (!keepAlive)
+            d_closeAfterWrite = true;
+
+        if (!d_response.cached && d_response.size() == 0)
+            d_response.cached = prerenderedResponse(d_response.code);
+
+        if (d_response.cached) {
+            const auto& cached = *d_response.cached;
+            bool transient = d_response.cachedTransient;
+            addWriteBuf(cached.headers().data(), cached.headers().size(), transient);
+            const auto& connection = keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE;
+            addWriteBuf(connection.data(), connection.size());
+            addWriteBuf(cached.tail().data(), cached.tail().size(), transient);
+            return;
+        }
+
+        formatHeaders(d_response);
+        addWriteBuf(d_headersRef.data(), d_headersRef.size());
+
+        if (d_response.size() && d_response.dataBuf.contains(d_response.data()))
+            d_bodyBuf = writeIndex + writeIoCount;
+
+        addWriteBuf(d_response.data(), d_response.size());
+    }
+
+    // moves a queued body out of d_response so it can serve the next request
+    void detachResponseBody()
+    {
+        if (d_bodyBuf >= MAX_WRITE_BUFS)
+            return;
+
+        auto& iov = writeBufs[d_bodyBuf];
+        char* dest = d_outBuf.data() + d_outUsed;
+        memcpy(dest, iov.iov_base, iov.iov_len);
+        iov.iov_base = dest;
+        d_outUsed += iov.iov_len;
+        d_bodyBuf = MAX_WRITE_BUFS;
+    }
+
+    // status of a pipelined POST, back on the connection's thread
+    void onWriteApplied(int status)
+    {
+        d_writePending = false;
+        keepAlive = d_pendingKeepAlive;
+
+        detachResponseBody();
+        d_handler.finishWrite(status, d_response);
+        if (status == 200)
+            d_response.setContentJson();
+
+        writeResponse(status);
+        keepAlive = false;
+    }
+
+    void writeResponse(int status)
+    {
+        EpochGuard guard;
+
+        queueResponse(status);
+        flushResponses();
+        stabilizeWrites();
+    }
+
+    // where the handler reports pipelined POSTs, nullptr if the
+    // transport can't take a status later
+    virtual WriteCompletion* writeCompletion()
+    {
+        return nullptr;
+    }
 
     virtual void startRead() = 0;
-    virtual void writeResponse(int status) = 0;
+    // sends everything queued in writeBufs, calls onWriteComplete when done;
+    // a transport that lets another thread continue a short write must
+    // stabilizeWrites() before it does
+    virtual void flushResponses() = 0;
     virtual void close() = 0;
 
     // HTTP parsing
@@ -252,17 +559,52 @@ public:
     bool headerDone = false;
     Handler::Method method;
 
-    std::string path;
-    std::string query;
-    std::string body;
+    // views into the read buffer, or into the copies
+    // below when the request spans several reads
+    boost::string_ref path;
+    boost::string_ref query;
+    boost::string_ref body;
+    std::string d_url;
+    std::string d_body;
     Response d_response;
 
     Handler& d_handler;
     boost::string_ref d_headersRef;
-    std::array<char, 2048> d_headersBuf;
-    std::array<char, CONN_BUF_SIZE> d_readBuf;
 
     size_t d_contentLength = 0;
     size_t d_dataRead = 0;
+
+    // a POST is with the writer thread, keepAlive is saved for its response
+    bool d_writePending = false;
+    bool d_pendingKeepAlive = false;
+
+    // served so far, 0 means no limit
+    size_t d_requests = 0;
+    size_t d_maxRequests = 0;
+
+    // queued responses
+    std::array<iovec, MAX_WRITE_BUFS> writeBufs;
+    size_t writeIndex = 0;
+    size_t writeIoCount = 0;
+    bool d_closeAfterWrite = false;
+    // writeBufs entries pointing into entity versions, one bit per entry
+    uint32_t d_transientBufs = 0;
+    // their copies once a write outlives the reader epoch
+    std::vector<std::unique_ptr<char[]>> d_stable;
+
+    // headers and detached bodies of queued responses,
+    // attached from the pool until they are written
+    PooledBuffer<OUT_BUF_SIZE> d_outBuf;
+    size_t d_outUsed = 0;
+    // writeBufs entry that points into d_response, if any
+    size_t d_bodyBuf = MAX_WRITE_BUFS;
+
+    // input that came behind a full pipeline
+    std::string d_pending;
+
+    // when the input being handled was read, admission counts queueing
+    // from there
+    uint64_t d_inputUs = 0;
+    uint64_t d_pendingUs = 0;
 };
 
@@ -1,12 +1,18 @@
 #include "database.h"
+#include "visit_filters.h"
 
 #include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <new>
+#include <thread>
+#include <unordered_map>
 #include <time.h>
 #include <stdio.h>
 
-#include <boost/date_time/gregorian/gregorian.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
@@ -27,9 +33,61 @@ std::string toJson(const T& entity)
     return std::string(buf.GetString(), buf.GetSize());
 }
 
+namespace {
+
+// Proleptic Gregorian calendar on day numbers since 1970-01-01
+
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = unsigned(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + int64_t(doe) - 719468;
+}
+
+void civilFromDays(int64_t z, int64_t& y, unsigned& m, unsigned& d)
+{
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = unsigned(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = int64_t(yoe) + era * 400 + (m <= 2);
+}
+
+unsigned lastDayOfMonth(int64_t y, unsigned m)
+{
+    static const unsigned days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = y % 4 == 0 && (y % 100 != 0 || y % 400 == 0);
+    return m == 2 && leap ? 29 : days[m - 1];
+}
+
+// the day the given number of years before, the last day of a month
+// stays the last day of the month like boost::gregorian::years does
+int64_t yearsBefore(int64_t day, uint32_t years)
+{
+    int64_t y;
+    unsigned m, d;
+    civilFromDays(day, y, m, d);
+
+    bool monthEnd = d == lastDayOfMonth(y, m);
+    y -= years;
+    unsigned last = lastDayOfMonth(y, m);
+
+    return daysFromCivil(y, m, monthEnd || d > last ? last : d);
+}
+
+} // namespace
+
 Database::Database()
 {
-    d_now = time(0);
+    setNow(time(0));
 }
 
 Database::~Database()
@@ -39,19 +97,74 @@ Database::~Database()
 void Database::setNow(uint32_t now)
 {
     d_now = now;
+
+    d_ageCuts.clear();
+    for (uint32_t age = 0; age <= MAX_AGE; ++age)
+        d_ageCuts.push_back(yearsBefore(d_now / 86400, age));
 }
 
-void Database::reserve(bool fullRun)
+// 2k when the user turns k today, 2k + 1 while between k and k + 1, so
+// the age filter of getAverage() keeps keys in [2 fromAge, 2 toAge]
+int32_t Database::ageKey(int32_t birth_date) const
 {
-    if (fullRun) {
-        d_users.reserve(1000074UL * 110/100);
-        d_locations.reserve(761314UL * 110/100);
-        d_visits.reserve(10000740UL * 110/100);
-    } else {
-        d_users.reserve(5000);
-        d_locations.reserve(5000);
-        d_visits.reserve(110000);
+    int32_t day = birth_date / 60 / 60 / 24;
+
+    // cuts descend, count those not before the birth day
+    size_t older = std::upper_bound(d_ageCuts.begin(), d_ageCuts.end(), day,
+            std::greater<int32_t>()) - d_ageCuts.begin();
+
+    int32_t age = int32_t(older) - 1;
+    bool birthday = older > 0 && d_ageCuts[older - 1] == day;
+
+    return 2 * age + (birthday ? 0 : 1);
+}
+
+AverageIndex::Sample Database::sample(const Visit& visit, const User& user) const
+{
+    return AverageIndex::Sample{user.gender, ageKey(user.birth_date), visit.visited_at, visit.mark};
+}
+
+void Database::indexLocation(LocationVisits& lv)
+{
+    if (lv.average.built() || lv.visits.size() < AverageIndex::HOT_VISITS)
+        return;
+
+    std::vector<AverageIndex::Sample> samples;
+    lv.visits.view().scan(0, uint64_t(1) << 32, [&](const OrderedVisits::Chunk& c, size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i)
+            samples.push_back(AverageIndex::Sample{c.genders()[i], ageKey(c.birthDates()[i]), c.visitedAt()[i], c.marks()[i]});
+    });
+
+    lv.average.build(samples);
+}
+
+void Database::beginBulkLoad()
+{
+    d_bulkLoad = true;
+}
+
+void Database::finishBulkLoad()
+{
+    if (!d_bulkLoad)
+        return;
+
+    d_bulkLoad = false;
+
+    size_t threadsCount = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < threadsCount; ++i) {
+        threads.emplace_back([this, i, threadsCount] {
+            d_users.forEachSlice(i, threadsCount, [](UserVisits& u) { u.visits.finishAppend(); });
+            d_locations.forEachSlice(i, threadsCount, [this](LocationVisits& l) {
+                l.visits.finishAppend();
+                indexLocation(l);
+            });
+        });
     }
+
+    for (auto& t: threads)
+        t.join();
 }
 
 void Database::printStat()
@@ -59,6 +172,8 @@ void Database::printStat()
     std::cout << "Users: " << d_users.size() << std::endl;
     std::cout << "Locations: " << d_locations.size() << std::endl;
     std::cout << "Visits: " << d_visits.size() << std::endl;
+    std::cout << "Places: " << placeNames().size() << ", countries: " << countryNames().size()
+        << ", cities: " << cityNames().size() << std::endl;
 }
 
 template <typename T>
@@ -88,8 +203,40 @@ bool loadString(std::string& dest, const rapidjson::Value& v, const char* name)
     return true;
 }
 
+bool loadInterned(uint32_t& dest, StringDictionary& dict, const rapidjson::Value& v, const char* name)
+{
+    if (v.HasMember(name)) {
+        const Value& item = v[name];
+        if (!item.IsString()) {
+            return false;
+        }
+        dest = dict.intern(boost::string_ref(item.GetString(), item.GetStringLength()));
+    }
+
+    return true;
+}
+
+StringDictionary& placeNames()
+{
+    static StringDictionary names;
+    return names;
+}
+
+StringDictionary& countryNames()
+{
+    static StringDictionary names;
+    return names;
+}
+
+StringDictionary& cityNames()
+{
+    static StringDictionary names;
+    return names;
+}
+
 #define LOAD_UINT_VALUE(name) if(!loadInt(name, v, #name)) { return false; }
 #define LOAD_STRING_VALUE(name) if(!loadString(name, v, #name)) { return false; }
+#define LOAD_INTERNED_VALUE(name, dict) if(!loadInterned(name, dict, v, #name)) { return false; }
 
 bool User::load(const rapidjson::Value & v)
 {
@@ -126,9 +273,9 @@ void User::store(rapidjson::Value& v, rapidjson::Document& d) const
 bool Location::load(const rapidjson::Value & v)
 {
     LOAD_UINT_VALUE(id);
-    LOAD_STRING_VALUE(place);
-    LOAD_STRING_VALUE(country);
-    LOAD_STRING_VALUE(city);
+    LOAD_INTERNED_VALUE(place, placeNames());
+    LOAD_INTERNED_VALUE(country, countryNames());
+    LOAD_INTERNED_VALUE(city, cityNames());
     LOAD_UINT_VALUE(distance);
 
     return true;
@@ -139,9 +286,12 @@ void Location::store(rapidjson::Value & v, rapidjson::Document& d) const
     auto& a = d.GetAllocator();
     v.SetObject();
     v.AddMember("id", Value(id), a);
-    v.AddMember("place", StringRef(place.data(), place.size()), a);
-    v.AddMember("country", StringRef(country.c_str(), country.size()), a);
-    v.AddMember("city", StringRef(city.c_str(), city.size()), a);
+    auto placeName = placeNames().get(place);
+    v.AddMember("place", StringRef(placeName.data(), placeName.size()), a);
+    auto countryName = countryNames().get(country);
+    auto cityName = cityNames().get(city);
+    v.AddMember("country", StringRef(countryName.data(), countryName.size()), a);
+    v.AddMember("city", StringRef(cityName.data(), cityName.size()), a);
     v.AddMember("distance", distance, a);
 }
 
@@ -179,46 +329,335 @@ void UserVisit::store(rapidjson::Value & v, rapidjson::Document& d)
 }
 
 
-bool visitedTimeLess(const VisitWrap* a, const VisitWrap* b)
+typedef OrderedVisits::Entry Entry;
+typedef OrderedVisits::Chunk Chunk;
+
+bool entryLess(const Entry& e, const std::pair<uint32_t, uint32_t>& key)
 {
-    return a->entity.visited_at < b->entity.visited_at;
+    return e.visited_at < key.first || (e.visited_at == key.first && e.id < key.second);
 }
 
-OrderedVisits::StorageT::iterator OrderedVisits::lower_bound(uint32_t visited_at)
+bool entryOrder(const Entry& a, const Entry& b)
 {
-    VisitWrap vw;
-    vw.entity.visited_at = visited_at;
+    return entryLess(a, std::make_pair(b.visited_at, b.id));
+}
+
+Chunk* Chunk::create(const Entry* begin, const Entry* end)
+{
+    size_t size = end - begin;
+    size_t bytes = sizeof(Chunk) + size * (sizeof(VisitWrap*) + sizeof(boost::string_ref) + 5 * sizeof(uint32_t) + 2);
+
+    Chunk* c = new (::operator new(bytes)) Chunk(size);
+
+    auto visits = const_cast<VisitWrap**>(c->visits());
+    auto places = const_cast<boost::string_ref*>(c->places());
+    auto visitedAt = c->column<uint32_t>(0);
+    auto ids = c->column<uint32_t>(1);
+    auto distances = c->column<uint32_t>(2);
+    auto birthDates = c->column<int32_t>(3);
+    auto countries = c->column<uint32_t>(4);
+    auto marks = const_cast<uint8_t*>(c->marks());
+    auto genders = const_cast<char*>(c->genders());
+
+    for (size_t i = 0; i < size; ++i) {
+        const Entry& e = begin[i];
+        visits[i] = e.visit;
+        new (places + i) boost::string_ref(e.place);
+        visitedAt[i] = e.visited_at;
+        ids[i] = e.id;
+        distances[i] = e.distance;
+        birthDates[i] = e.birth_date;
+        countries[i] = e.country;
+        marks[i] = e.mark;
+        genders[i] = e.gender;
+    }
 
-    return std::lower_bound(visits.begin(), visits.end(), &vw, visitedTimeLess);
+    return c;
 }
 
-void OrderedVisits::add(VisitWrap* v)
+Entry Chunk::entry(size_t i) const
 {
-    visits.push_back(v);
-    normalize();
+    return Entry{visitedAt()[i], ids()[i], visits()[i], marks()[i],
+        genders()[i], birthDates()[i], distances()[i], countries()[i], places()[i]};
 }
 
-void OrderedVisits::normalize()
+std::pair<uint32_t, uint32_t> Chunk::back() const
 {
-    visits.shrink_to_fit();
-    std::sort(visits.begin(), visits.end(), visitedTimeLess);
+    return std::make_pair(visitedAt()[d_size - 1], ids()[d_size - 1]);
 }
 
-void OrderedVisits::remove(uint32_t visit_id)
+size_t Chunk::lower_bound(uint32_t visited_at, uint32_t id) const
 {
-    for (auto it = visits.begin(); it != visits.end(); ++it) {
-        if ((*it)->entity.id == visit_id) {
-            visits.erase(it);
-            return;
+    auto at = visitedAt();
+    size_t from = std::lower_bound(at, at + d_size, visited_at) - at;
+    size_t to = std::upper_bound(at + from, at + d_size, visited_at) - at;
+
+    return std::lower_bound(ids() + from, ids() + to, id) - ids();
+}
+
+namespace {
+
+// rows of a chunk, for changes that rebuild it
+std::vector<Entry> unpack(const Chunk& c, size_t extra = 0)
+{
+    std::vector<Entry> entries;
+    entries.reserve(c.size() + extra);
+    for (size_t i = 0; i < c.size(); ++i)
+        entries.push_back(c.entry(i));
+    return entries;
+}
+
+Chunk* makeChunk(const std::vector<Entry>& entries, size_t from, size_t to)
+{
+    return Chunk::create(entries.data() + from, entries.data() + to);
+}
+
+// evenly filled chunks of at most MAX_CHUNK entries
+void pushChunks(OrderedVisits::ChunkList& list, const std::vector<Entry>& entries)
+{
+    size_t pieces = (entries.size() + OrderedVisits::MAX_CHUNK - 1) / OrderedVisits::MAX_CHUNK;
+    for (size_t i = 0; i < pieces; ++i)
+        list.push_back(makeChunk(entries, entries.size() * i / pieces, entries.size() * (i + 1) / pieces));
+}
+
+} // namespace
+
+// index of the first chunk whose last entry is not less than the key
+size_t findChunk(const OrderedVisits::ChunkList& chunks, uint32_t visited_at, uint32_t id)
+{
+    auto key = std::make_pair(visited_at, id);
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), key,
+            [](const Chunk* c, const std::pair<uint32_t, uint32_t>& k) {
+                return c->back() < k;
+            });
+
+    return it - chunks.begin();
+}
+
+OrderedVisits::iterator OrderedVisits::View::lower_bound(uint32_t visited_at) const
+{
+    size_t ci = findChunk(*d_chunks, visited_at, 0);
+    if (ci == d_chunks->size())
+        return end();
+
+    return iterator(d_chunks, ci, (*d_chunks)[ci]->lower_bound(visited_at, 0));
+}
+
+OrderedVisits::~OrderedVisits()
+{
+    // the list itself goes with d_chunks
+    if (auto chunks = d_chunks.get()) {
+        for (auto c: *chunks)
+            delete c;
+    }
+}
+
+OrderedVisits::View OrderedVisits::view() const
+{
+    static const ChunkList empty;
+
+    auto chunks = d_chunks.get();
+    return View(chunks ? chunks : &empty);
+}
+
+void OrderedVisits::add(const Entry& entry)
+{
+    auto current = d_chunks.get();
+    std::unique_ptr<ChunkList> next(current ? new ChunkList(*current) : new ChunkList());
+
+    if (next->empty()) {
+        next->push_back(Chunk::create(&entry, &entry + 1));
+        d_chunks.publish(next.release());
+        return;
+    }
+
+    size_t ci = std::min(findChunk(*next, entry.visited_at, entry.id), next->size() - 1);
+    const Chunk* old = (*next)[ci];
+
+    auto entries = unpack(*old, 1);
+    entries.insert(entries.begin() + old->lower_bound(entry.visited_at, entry.id), entry);
+
+    if (entries.size() > MAX_CHUNK) {
+        size_t half = entries.size() / 2;
+        (*next)[ci] = makeChunk(entries, 0, half);
+        next->insert(next->begin() + ci + 1, makeChunk(entries, half, entries.size()));
+    } else {
+        (*next)[ci] = makeChunk(entries, 0, entries.size());
+    }
+
+    d_chunks.publish(next.release());
+    Epoch::retire(old);
+}
+
+void OrderedVisits::add(std::vector<Entry>& entries)
+{
+    if (entries.empty())
+        return;
+
+    std::sort(entries.begin(), entries.end(), entryOrder);
+
+    auto current = d_chunks.get();
+    std::unique_ptr<ChunkList> next(new ChunkList());
+    next->reserve((current ? current->size() : 0) + entries.size() / MAX_CHUNK + 1);
+
+    // merges the new entries into every chunk they belong to,
+    // the last chunk takes whatever is past its tail
+    auto ei = entries.begin();
+    size_t count = current ? current->size() : 0;
+
+    for (size_t ci = 0; ci < count; ++ci) {
+        const Chunk* old = (*current)[ci];
+
+        auto ee = ci + 1 == count ? entries.end() :
+            std::upper_bound(ei, entries.end(), old->back(),
+                    [](const std::pair<uint32_t, uint32_t>& k, const Entry& e) {
+                        return k < std::make_pair(e.visited_at, e.id);
+                    });
+
+        if (ei == ee) {
+            next->push_back(old);
+            continue;
         }
+
+        auto rows = unpack(*old);
+        std::vector<Entry> merged;
+        merged.reserve(rows.size() + (ee - ei));
+        std::merge(rows.begin(), rows.end(), ei, ee, std::back_inserter(merged), entryOrder);
+        pushChunks(*next, merged);
+
+        Epoch::retire(old);
+        ei = ee;
     }
+
+    if (ei != entries.end())
+        pushChunks(*next, std::vector<Entry>(ei, entries.end()));
+
+    d_chunks.publish(next.release());
 }
 
-void VisitWrap::getJson(boost::string_ref& ref) const {
-    if (ref.size() < 80)
+void OrderedVisits::remove(uint32_t visited_at, uint32_t visit_id)
+{
+    auto current = d_chunks.get();
+    if (!current)
+        return;
+
+    size_t ci = findChunk(*current, visited_at, visit_id);
+    if (ci == current->size())
+        return;
+
+    const Chunk* old = (*current)[ci];
+    size_t pos = old->lower_bound(visited_at, visit_id);
+    if (pos == old->size() || old->visitedAt()[pos] != visited_at || old->ids()[pos] != visit_id)
+        return;
+
+    std::unique_ptr<ChunkList> next(new ChunkList(*current));
+
+    if (old->size() == 1) {
+        next->erase(next->begin() + ci);
+        d_chunks.publish(next.release());
+        Epoch::retire(old);
+        return;
+    }
+
+    // merge a shrunk chunk with its neighbour while both fit
+    const Chunk* neighbour = nullptr;
+    if (old->size() - 1 < MAX_CHUNK / 4 && ci + 1 < next->size()
+            && old->size() - 1 + (*next)[ci + 1]->size() <= MAX_CHUNK)
+        neighbour = (*next)[ci + 1];
+
+    auto entries = unpack(*old, neighbour ? neighbour->size() : 0);
+    entries.erase(entries.begin() + pos);
+
+    if (neighbour) {
+        for (size_t i = 0; i < neighbour->size(); ++i)
+            entries.push_back(neighbour->entry(i));
+        next->erase(next->begin() + ci + 1);
+    }
+
+    (*next)[ci] = makeChunk(entries, 0, entries.size());
+    d_chunks.publish(next.release());
+    Epoch::retire(old);
+    Epoch::retire(neighbour);
+}
+
+void OrderedVisits::update(const Entry& entry)
+{
+    auto current = d_chunks.get();
+    if (!current)
+        return;
+
+    size_t ci = findChunk(*current, entry.visited_at, entry.id);
+    if (ci == current->size())
         return;
 
-    int sz = snprintf((char*)ref.data(), ref.size(),
+    const Chunk* old = (*current)[ci];
+    size_t pos = old->lower_bound(entry.visited_at, entry.id);
+    if (pos == old->size() || old->visitedAt()[pos] != entry.visited_at || old->ids()[pos] != entry.id)
+        return;
+
+    auto entries = unpack(*old);
+    entries[pos] = entry;
+
+    std::unique_ptr<ChunkList> next(new ChunkList(*current));
+    (*next)[ci] = makeChunk(entries, 0, entries.size());
+    d_chunks.publish(next.release());
+    Epoch::retire(old);
+}
+
+size_t OrderedVisits::size() const
+{
+    size_t count = 0;
+    if (auto chunks = d_chunks.get()) {
+        for (auto c: *chunks)
+            count += c->size();
+    }
+    return count;
+}
+
+void OrderedVisits::append(const Entry& entry)
+{
+    if (!d_staged)
+        d_staged.reset(new std::vector<Entry>());
+
+    d_staged->push_back(entry);
+}
+
+void OrderedVisits::finishAppend()
+{
+    if (!d_staged)
+        return;
+
+    std::vector<Entry> all;
+    all.swap(*d_staged);
+    d_staged.reset();
+
+    auto current = d_chunks.get();
+    if (current) {
+        for (auto c: *current) {
+            for (size_t i = 0; i < c->size(); ++i)
+                all.push_back(c->entry(i));
+        }
+    }
+
+    std::sort(all.begin(), all.end(), entryOrder);
+
+    // evenly filled chunks, allocated to their exact size
+    std::unique_ptr<ChunkList> sorted(new ChunkList());
+    sorted->reserve((all.size() + MAX_CHUNK - 1) / MAX_CHUNK);
+    pushChunks(*sorted, all);
+
+    d_chunks.publish(sorted.release());
+
+    if (current) {
+        for (auto c: *current)
+            Epoch::retire(c);
+    }
+}
+
+void VisitVersion::render() {
+    char json[128];
+
+    int sz = snprintf(json, sizeof(json),
             "{\"user\": %u, \"location\": %u, \"visited_at\": %u, \"id\": %u, \"mark\": %u}",
             entity.user, 
             entity.location, 
@@ -226,10 +665,114 @@ void VisitWrap::getJson(boost::string_ref& ref) const {
             entity.id, 
             entity.mark);
 
-    ref = boost::string_ref(ref.data(), sz);
+    response.render(boost::string_ref(json, sz));
 }
 
 
+// Holds a few stripe locks, taken in address order and each only once.
+class StripeGuard
+{
+public:
+
+    StripeGuard() {}
+    StripeGuard(const StripeGuard&) = delete;
+    StripeGuard& operator =(const StripeGuard&) = delete;
+
+    ~StripeGuard()
+    {
+        while (d_count > 0)
+            d_locks[--d_count]->unlock();
+    }
+
+    void add(std::mutex* m)
+    {
+        d_locks[d_count++] = m;
+    }
+
+    void lock()
+    {
+        std::sort(d_locks, d_locks + d_count);
+        d_count = std::unique(d_locks, d_locks + d_count) - d_locks;
+
+        for (size_t i = 0; i < d_count; ++i)
+            d_locks[i]->lock();
+    }
+
+private:
+
+    std::mutex* d_locks[5];
+    size_t d_count = 0;
+};
+
+// Any number of stripes of one table, taken in index order, which is
+// address order too.
+template <size_t STRIPES>
+class StripeSet
+{
+public:
+
+    explicit StripeSet(std::mutex* table)
+        : d_table(table) {}
+
+    StripeSet(const StripeSet&) = delete;
+    StripeSet& operator =(const StripeSet&) = delete;
+
+    ~StripeSet()
+    {
+        unlock();
+    }
+
+    void add(uint32_t id)
+    {
+        d_stripes.set(id % STRIPES);
+    }
+
+    void add(const StripeSet& other)
+    {
+        d_stripes |= other.d_stripes;
+    }
+
+    bool contains(const StripeSet& other) const
+    {
+        return (other.d_stripes & ~d_stripes).none();
+    }
+
+    void lock()
+    {
+        for (size_t i = 0; i < STRIPES; ++i) {
+            if (d_stripes[i])
+                d_table[i].lock();
+        }
+        d_locked = true;
+    }
+
+    void unlock()
+    {
+        if (!d_locked)
+            return;
+
+        for (size_t i = STRIPES; i-- > 0;) {
+            if (d_stripes[i])
+                d_table[i].unlock();
+        }
+        d_locked = false;
+    }
+
+private:
+
+    std::mutex* d_table;
+    std::bitset<STRIPES> d_stripes;
+    bool d_locked = false;
+};
+
+// list entry of a visit, with the user and location attributes scans use
+Entry makeEntry(VisitWrap* vw, const Visit& visit, const User& user, const Location& location)
+{
+    return Entry{visit.visited_at, visit.id, vw, visit.mark,
+        user.gender, user.birth_date, location.distance, location.country,
+        placeNames().get(location.place)};
+}
+
 template <typename MapT, typename T>
 bool getEntity(MapT& m, uint32_t id, T& value)
 {
@@ -237,52 +780,51 @@ bool getEntity(MapT& m, uint32_t id, T& value)
     if (it == m.end())
         return false;
 
-    value = it->entity;
+    value = it->current.get()->entity;
     return true;
 }
 
 template <typename MapT>
-bool getEntityJson(MapT& m, uint32_t id, boost::string_ref& value)
+bool getEntityResponse(MapT& m, uint32_t id, const CachedResponse*& value)
 {
     auto it = m.find(id);
     if (it == m.end())
         return false;
 
-    it->getJson(value);
+    value = &it->current.get()->response;
     return true;
 }
 
-template <typename Entity, typename MapT>
-Database::UpdateResult updateEntity(MapT& m, uint32_t id, const rapidjson::Value & v)
+template <typename Entity>
+EntityVersion<Entity>* makeVersion(const Entity& entity)
 {
-    auto it = m.find(id);
-    if (it == m.end())
-        return Database::UpdateResult::notFound;
-
-    auto& holder = *it;
-    Entity item(holder.entity);
-
-    if (!item.load(v))
-        return Database::UpdateResult::badData;
+    auto version = new EntityVersion<Entity>();
+    version->entity = entity;
+    version->response.render(toJson(entity));
+    return version;
+}
 
-    holder.json = toJson(item);
-    holder.entity = std::move(item);
-    return Database::UpdateResult::ok;
+// visits may refer to entities not created yet, they get a default version
+template <typename Entity, typename Holder>
+void ensureVersion(Holder& holder)
+{
+    if (!holder.current.get())
+        holder.current.publish(makeVersion(Entity()));
 }
 
-bool Database::getUser(uint32_t id, boost::string_ref& res)
+bool Database::getUser(uint32_t id, const CachedResponse*& res)
 {
-    return getEntityJson(d_users, id, res);
+    return getEntityResponse(d_users, id, res);
 }
 
-bool Database::getLocation(uint32_t id, boost::string_ref& res)
+bool Database::getLocation(uint32_t id, const CachedResponse*& res)
 {
-    return getEntityJson(d_locations, id, res);
+    return getEntityResponse(d_locations, id, res);
 }
 
-bool Database::getVisit(uint32_t id, boost::string_ref& res)
+bool Database::getVisit(uint32_t id, const CachedResponse*& res)
 {
-    return getEntityJson(d_visits, id, res);
+    return getEntityResponse(d_visits, id, res);
 }
 
 bool Database::get(uint32_t id, User& user)
@@ -300,14 +842,127 @@ bool Database::get(uint32_t id, Visit& visit)
     return getEntity(d_visits, id, visit);
 }
 
+// Caller holds the user stripe. Location lists copy gender and birth
+// date, a change of either is written into the entries of every visit
+// of the user, and moves the avg samples between index partitions.
+// All those location stripes are held across the switch, so nothing
+// is built from the new version and then changed again.
+void Database::publishUser(UserVisits& uv, const User& user)
+{
+    const auto* old = uv.current.get();
+    if (!old || (old->entity.gender == user.gender && old->entity.birth_date == user.birth_date)) {
+        uv.current.publish(makeVersion(user));
+        return;
+    }
+
+    // staged entries are not patched, see beginBulkLoad()
+    assert(!d_bulkLoad);
+
+    const User before(old->entity);
+    bool moved = before.gender != user.gender || ageKey(before.birth_date) != ageKey(user.birth_date);
+    auto visits = uv.visits.view();
+
+    StripeSet<LOCK_STRIPES> locations(stripe(LocationLocks, 0));
+    for (auto vw: visits)
+        locations.add(vw->current.get()->entity.location);
+    locations.lock();
+
+    uv.current.publish(makeVersion(user));
+
+    for (auto vw: visits) {
+        const VisitVersion* v = vw->current.get();
+        LocationVisits& lv = *v->location;
+
+        lv.visits.update(makeEntry(vw, v->entity, user, lv.current.get()->entity));
+
+        if (moved && lv.average.built()) {
+            lv.average.remove(sample(v->entity, before));
+            lv.average.add(sample(v->entity, user));
+        }
+    }
+}
+
 Database::UpdateResult Database::updateUser(uint32_t id, const rapidjson::Value& v)
 {
-    return updateEntity<User>(d_users, id, v);
+    std::lock_guard<std::mutex> lk(*stripe(UserLocks, id));
+
+    auto it = d_users.find(id);
+    if (it == d_users.end())
+        return UpdateResult::notFound;
+
+    User item(it->current.get()->entity);
+    if (!item.load(v))
+        return UpdateResult::badData;
+
+    publishUser(*it, item);
+    return UpdateResult::ok;
+}
+
+// User lists copy place, distance and country, a change of any of them
+// is written into the entries of every visit of the location. Their user stripes go before
+// the location stripe, so the set is read first and checked again once
+// everything is locked.
+template <typename Change>
+Database::UpdateResult Database::publishLocation(LocationVisits& lv, uint32_t id, Change change)
+{
+    {
+        std::lock_guard<std::mutex> lk(*stripe(LocationLocks, id));
+
+        const auto* old = lv.current.get();
+        Location item(old ? old->entity : Location());
+        if (!change(item))
+            return UpdateResult::badData;
+
+        if (!old || (old->entity.place == item.place && old->entity.distance == item.distance
+                    && old->entity.country == item.country)) {
+            lv.current.publish(makeVersion(item));
+            return UpdateResult::ok;
+        }
+    }
+
+    // staged entries are not patched, see beginBulkLoad()
+    assert(!d_bulkLoad);
+
+    StripeSet<LOCK_STRIPES> users(stripe(UserLocks, 0));
+    std::unique_lock<std::mutex> lk(*stripe(LocationLocks, id), std::defer_lock);
+
+    while (true) {
+        users.lock();
+        lk.lock();
+
+        StripeSet<LOCK_STRIPES> needed(stripe(UserLocks, 0));
+        for (auto vw: lv.visits.view())
+            needed.add(vw->current.get()->entity.user);
+
+        if (users.contains(needed))
+            break;
+
+        lk.unlock();
+        users.unlock();
+        users.add(needed);
+    }
+
+    Location item(lv.current.get()->entity);
+    if (!change(item))
+        return UpdateResult::badData;
+
+    lv.current.publish(makeVersion(item));
+
+    for (auto vw: lv.visits.view()) {
+        const VisitVersion* v = vw->current.get();
+        v->user->visits.update(makeEntry(vw, v->entity, v->user->current.get()->entity, item));
+    }
+
+    return UpdateResult::ok;
 }
 
 Database::UpdateResult Database::updateLocation(uint32_t id, const rapidjson::Value& v)
 {
-    return updateEntity<Location>(d_locations, id, v);
+    auto it = d_locations.find(id);
+    if (it == d_locations.end())
+        return UpdateResult::notFound;
+
+    return publishLocation(*it, id, [&v](Location& item) { return item.load(v); });
 }
 
 Database::UpdateResult Database::updateVisit(uint32_t id, const rapidjson::Value& v)
@@ -316,8 +971,12 @@ Database::UpdateResult Database::updateVisit(uint32_t id, const rapidjson::Value
     if (it == d_visits.end())
         return UpdateResult::notFound;
 
+    // the visit lock keeps its version stable while we look at it
+    std::lock_guard<std::mutex> lk(*stripe(VisitLocks, id));
+
     VisitWrap& vw = *it;
-    Visit oldValue = vw.entity;
+    const VisitVersion* old = vw.current.get();
+    const Visit& oldValue = old->entity;
     Visit newValue(oldValue);
     
     if (!newValue.load(v))
@@ -331,60 +990,187 @@ Database::UpdateResult Database::updateVisit(uint32_t id, const rapidjson::Value
     if (locationIt == d_locations.end())
         return UpdateResult::badData;
 
-    // overwrite value in the db
-    vw.entity = newValue;
-
-    if (oldValue.user != newValue.user) {
-        vw.user->visits.remove(oldValue.id);
-        vw.user = userIt;
-        vw.user->visits.add(&vw);
+    std::unique_ptr<VisitVersion> next(new VisitVersion());
+    next->entity = newValue;
+    next->user = userIt;
+    next->location = locationIt;
+    next->render();
+
+    // ordering keys change, take the visit out under the old ones
+    bool keyChanged = oldValue.visited_at != newValue.visited_at || oldValue.id != newValue.id;
+    bool userChanged = keyChanged || oldValue.user != newValue.user;
+    bool locationChanged = keyChanged || oldValue.location != newValue.location;
+
+    // user and location stripes come after every visit stripe. Any change
+    // may move the avg sample, which needs both users stable and both
+    // location indexes locked.
+    StripeGuard lists;
+    lists.add(stripe(UserLocks, oldValue.user));
+    lists.add(stripe(UserLocks, newValue.user));
+    lists.add(stripe(LocationLocks, oldValue.location));
+    lists.add(stripe(LocationLocks, newValue.location));
+    lists.lock();
+
+    if (old->location->average.built())
+        old->location->average.remove(sample(oldValue, old->user->current.get()->entity));
+
+    const User& user = userIt->current.get()->entity;
+    auto entry = makeEntry(&vw, newValue, user, locationIt->current.get()->entity);
+
+    if (userChanged) {
+        old->user->visits.remove(oldValue.visited_at, oldValue.id);
+        userIt->visits.add(entry);
+    } else {
+        userIt->visits.update(entry);
     }
 
-    if (oldValue.location != newValue.location) {
-        vw.location->visits.remove(oldValue.id);
-        vw.location = locationIt;
-        vw.location->visits.add(&vw);
+    if (locationChanged) {
+        old->location->visits.remove(oldValue.visited_at, oldValue.id);
+        locationIt->visits.add(entry);
+    } else {
+        locationIt->visits.update(entry);
     }
 
-    if (oldValue.visited_at != newValue.visited_at) {
-        vw.location->visits.normalize();
-        vw.user->visits.normalize();
-    }
+    // old is retired here, don't touch it below
+    vw.current.publish(next.release());
+
+    if (locationIt->average.built())
+        locationIt->average.add(sample(newValue, user));
+    else if (locationChanged)
+        indexLocation(*locationIt);
 
     return UpdateResult::ok;
 }
 
 bool Database::create(const User & user)
 {
+    std::lock_guard<std::mutex> lk(*stripe(UserLocks, user.id));
+
+    // visits may have come first and sampled a default version
     auto& item = d_users[user.id];
-    item.entity = user;
-    item.json = toJson(user);
+    publishUser(item, user);
+    d_users.publish(user.id);
    
     return true;
 }
 
 bool Database::create(const Location& location)
 {
+    // visits may have come first and copied a default version
     auto& item = d_locations[location.id];
-    item.entity = location;
-    item.json = toJson(location);
+    publishLocation(item, location.id, [&location](Location& l) { l = location; return true; });
+    d_locations.publish(location.id);
 
     return true;
 }
 
 bool Database::create(const Visit & visit)
 {
+    StripeGuard locks;
+    locks.add(stripe(VisitLocks, visit.id));
+    locks.add(stripe(UserLocks, visit.user));
+    locks.add(stripe(LocationLocks, visit.location));
+    locks.lock();
+
     VisitWrap& dest = d_visits[visit.id];
 
     auto& lv = d_locations[visit.location];
     auto& uv = d_users[visit.user];
 
-    dest.entity = visit;
-    dest.location = &lv;
-    dest.user = &uv;
+    ensureVersion<Location>(lv);
+    ensureVersion<User>(uv);
 
-    uv.visits.add(&dest);
-    lv.visits.add(&dest);
+    auto version = new VisitVersion();
+    version->entity = visit;
+    version->location = &lv;
+    version->user = &uv;
+    version->render();
+    dest.current.publish(version);
+
+    auto entry = makeEntry(&dest, visit, uv.current.get()->entity, lv.current.get()->entity);
+
+    if (d_bulkLoad) {
+        uv.visits.append(entry);
+        lv.visits.append(entry);
+    } else {
+        uv.visits.add(entry);
+        lv.visits.add(entry);
+
+        if (lv.average.built())
+            lv.average.add(sample(visit, uv.current.get()->entity));
+        else
+            indexLocation(lv);
+    }
+
+    d_visits.publish(visit.id);
+
+    return true;
+}
+
+bool Database::create(const std::vector<Visit>& visits)
+{
+    if (visits.size() == 1)
+        return create(visits.front());
+
+    // every stripe of the batch is held throughout, so a user or location
+    // change can't slip in between making the entries and adding them
+    StripeSet<LOCK_STRIPES> visitLocks(stripe(VisitLocks, 0));
+    StripeSet<LOCK_STRIPES> userLocks(stripe(UserLocks, 0));
+    StripeSet<LOCK_STRIPES> locationLocks(stripe(LocationLocks, 0));
+
+    for (const auto& visit: visits) {
+        visitLocks.add(visit.id);
+        userLocks.add(visit.user);
+        locationLocks.add(visit.location);
+    }
+
+    visitLocks.lock();
+    userLocks.lock();
+    locationLocks.lock();
+
+    // list entries by user and location id
+    std::unordered_map<uint32_t, std::vector<OrderedVisits::Entry>> userEntries;
+    std::unordered_map<uint32_t, std::vector<OrderedVisits::Entry>> locationEntries;
+
+    for (const auto& visit: visits) {
+        VisitWrap& dest = d_visits[visit.id];
+
+        auto& lv = d_locations[visit.location];
+        auto& uv = d_users[visit.user];
+
+        ensureVersion<Location>(lv);
+        ensureVersion<User>(uv);
+
+        auto version = new VisitVersion();
+        version->entity = visit;
+        version->location = &lv;
+        version->user = &uv;
+        version->render();
+        dest.current.publish(version);
+
+        auto entry = makeEntry(&dest, visit, uv.current.get()->entity, lv.current.get()->entity);
+        userEntries[visit.user].push_back(entry);
+        locationEntries[visit.location].push_back(entry);
+    }
+
+    for (auto& kv: userEntries)
+        d_users[kv.first].visits.add(kv.second);
+
+    for (auto& kv: locationEntries) {
+        auto& lv = d_locations[kv.first];
+        lv.visits.add(kv.second);
+
+        if (!lv.average.built()) {
+            indexLocation(lv);
+            continue;
+        }
+
+        for (const auto& e: kv.second)
+            lv.average.add(AverageIndex::Sample{e.gender, ageKey(e.birth_date), e.visited_at, e.mark});
+    }
+
+    for (const auto& visit: visits)
+        d_visits.publish(visit.id);
 
     return true;
 }
@@ -396,86 +1182,104 @@ bool Database::getVisits(uint32_t user, const VisitsQuery& q, std::vector<UserVi
         return false;
     }
 
-    auto& userVisits = it->visits;
-    auto vi = q.fromDate ? userVisits.lower_bound(q.fromDate) : userVisits.begin();
+    PlaceFilter filter;
+    filter.toDistance = q.toDistance;
 
-    for (; vi != userVisits.end(); ++vi) {
-        const auto& v = *vi;
+    // no location is in a country nobody has mentioned
+    if (!countryNames().find(q.country, filter.country)) {
+        return true;
+    }
 
-        if (q.toDate && v->entity.visited_at >= q.toDate) {
-            break;
-        }
+    uint64_t untilDate = q.toDate ? q.toDate : uint64_t(1) << 32;
+    uint8_t selected[OrderedVisits::MAX_CHUNK];
+    PlaceKernel kernel = placeKernel(filter);
 
-        if (q.toDistance && v->location->entity.distance >= q.toDistance) {
-            continue;
-        }
+    it->visits.view().scan(q.fromDate, untilDate, [&](const OrderedVisits::Chunk& c, size_t from, size_t to) {
+        size_t count = kernel(c.distances() + from, c.countries() + from, to - from, filter, selected);
 
-        if (!q.country.empty() && q.country != v->location->entity.country) {
-            continue;
+        for (size_t k = 0; k < count; ++k) {
+            size_t i = from + selected[k];
+            visits.emplace_back(UserVisit{c.marks()[i], c.visitedAt()[i], c.places()[i]});
         }
-
-        visits.emplace_back(UserVisit{v->entity.mark, v->entity.visited_at, v->location->entity.place});
-    }
+    });
 
     return true;
 }
 
+namespace {
+
+// birth_date is turned into a day by truncating division, these are the
+// first and the last second that land on the given day
+int64_t firstBirthSecond(int64_t day)
+{
+    return day > 0 ? day * 86400 : (day - 1) * 86400 + 1;
+}
+
+int64_t lastBirthSecond(int64_t day)
+{
+    return day >= 0 ? (day + 1) * 86400 - 1 : day * 86400;
+}
+
+} // namespace
 
 bool Database::getAverage(uint32_t location, const AverageQuery& q, double& avg)
 {
     avg = 0;
-    double sum = 0.0;
-    size_t count = 0;
 
     auto locIt = d_locations.find(location);
     if (locIt == d_locations.end()) {
         return false;
     }
 
-    bool ageFilter = false;
-    boost::gregorian::date fromBirth = boost::gregorian::date(boost::gregorian::special_values::min_date_time);
-    boost::gregorian::date toBirth = boost::gregorian::date(boost::gregorian::special_values::max_date_time);
-    boost::gregorian::date epoch(1970, 1, 1);
-
-    if (q.fromAge || q.toAge) {
-        auto today = boost::posix_time::from_time_t(d_now).date();
+    if (locIt->average.built() && q.fromAge <= MAX_AGE && q.toAge <= MAX_AGE) {
+        int32_t minKey = q.fromAge ? 2 * int32_t(q.fromAge) : INT32_MIN;
+        int32_t maxKey = q.toAge ? 2 * int32_t(q.toAge) : INT32_MAX;
 
-        if (q.fromAge) {
-            toBirth = today - boost::gregorian::years(q.fromAge);
-        }
+        uint64_t marks, visits;
+        locIt->average.query(q.gender, minKey, maxKey, q.fromDate, q.toDate, marks, visits);
 
-        if (q.toAge) {
-            fromBirth = today - boost::gregorian::years(q.toAge);
-        }
+        if (visits)
+            avg = double(marks) / visits;
 
-        ageFilter = true;
+        return true;
     }
 
-    LocationVisits& lv = *locIt;
-    auto vi = q.fromDate ? lv.visits.lower_bound(q.fromDate) : lv.visits.begin();
+    MarkFilter filter;
+    filter.gender = q.gender;
 
-    for (; vi != lv.visits.end(); ++vi) {
-        const auto& visit = *vi;
-        if (q.toDate && visit->entity.visited_at > q.toDate)
-            break;
+    if (q.fromAge || q.toAge) {
+        int64_t today = d_now / 86400;
+        int64_t fromBirth = INT32_MIN;
+        int64_t toBirth = INT32_MAX;
 
-        if (q.gender && visit->user->entity.gender != q.gender)
-            continue;
+        if (q.fromAge) {
+            toBirth = std::min(toBirth, lastBirthSecond(yearsBefore(today, q.fromAge)));
+        }
 
-        if (ageFilter) {
-            auto userBirthdate = epoch + boost::gregorian::date_duration(visit->user->entity.birth_date / 60 / 60 / 24);
-            if (userBirthdate < fromBirth || userBirthdate > toBirth)
-                continue;
+        if (q.toAge) {
+            fromBirth = std::max(fromBirth, firstBirthSecond(yearsBefore(today, q.toAge)));
         }
 
-        ++count;
+        // a range past what birth_date holds matches nobody
+        if (fromBirth > toBirth) {
+            return true;
+        }
 
-        sum += visit->entity.mark;
+        filter.fromBirth = fromBirth;
+        filter.toBirth = toBirth;
     }
 
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    uint64_t untilDate = q.toDate ? uint64_t(q.toDate) + 1 : uint64_t(1) << 32;
+    MarkKernel kernel = markKernel(filter);
+
+    locIt->visits.view().scan(q.fromDate, untilDate, [&](const OrderedVisits::Chunk& c, size_t from, size_t to) {
+        kernel(c.marks() + from, c.genders() + from, c.birthDates() + from, to - from, filter, sum, count);
+    });
+
     if (count)
-        avg =sum / count;
+        avg = double(sum) / count;
 
     return true;
 }
-
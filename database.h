@@ -1,16 +1,23 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
+#include <memory>
+#include <mutex>
 
 #include <rapidjson/document.h>
 #include <boost/utility/string_ref.hpp>
 
-#include "hybridhash.h"
+#include "average_index.h"
+#include "epoch.h"
+#include "id_index.h"
+#include "string_dictionary.h"
+#include "cached_response.h"
 
 struct User
 {
@@ -25,12 +32,18 @@ struct User
     void store(rapidjson::Value& v, rapidjson::Document& d) const;
 };
 
+// places, countries and cities of all locations
+StringDictionary& placeNames();
+StringDictionary& countryNames();
+StringDictionary& cityNames();
+
 struct Location
 {
     uint32_t id = 0;
-    std::string place;
-    std::string country;
-    std::string city;
+    // ids in placeNames(), countryNames() and cityNames()
+    uint32_t place = 0;
+    uint32_t country = 0;
+    uint32_t city = 0;
     uint32_t distance;
 
     bool load(const rapidjson::Value& v);
@@ -75,15 +88,31 @@ struct AverageQuery
 struct UserVisits;
 struct LocationVisits;
 
-struct VisitWrap {
+// Published entity state, never modified once readers may see it.
+// Updates publish a new version and retire the old one.
+template <typename T>
+struct EntityVersion
+{
+    T entity;
+    CachedResponse response;
+};
+
+struct VisitVersion
+{
     Visit entity;
-    
-    void getJson(boost::string_ref& ref) const;
+    CachedResponse response;
+
+    void render();
 
     UserVisits* user;
     LocationVisits* location;
 };
 
+struct VisitWrap
+{
+    Versioned<VisitVersion> current;
+};
+
 struct UserVisit
 {
     uint8_t mark;
@@ -94,29 +123,239 @@ struct UserVisit
 };
 
 
+// Visits ordered by (visited_at, id), kept in sorted chunks of bounded
+// size. Chunks and the chunk list are copied on write and published as
+// a whole, so a reader walks a consistent snapshot while writers go on.
+// Insert and remove copy at most one chunk and the list of chunk
+// pointers, lookups are a binary search over chunk tails followed by
+// one inside the chunk.
+//
+// Chunks are stored by column and carry copies of the attributes the
+// queries filter on, so a scan streams through a few arrays instead of
+// following each visit to its user or location. The copies are kept
+// up to date by the database.
 struct OrderedVisits
 {
-    typedef std::vector<VisitWrap*> StorageT;
-    StorageT visits;
-    
-    StorageT::iterator begin() { return visits.begin(); }
-    StorageT::iterator end() { return visits.end(); }
-    StorageT::iterator lower_bound(uint32_t visited_at);
+    struct Entry
+    {
+        uint32_t visited_at;
+        uint32_t id;
+        VisitWrap* visit;
+        uint8_t mark;
+
+        // of the user, filtered on by location lists
+        char gender;
+        int32_t birth_date;
+
+        // of the location, filtered on by user lists and listed with
+        // the visit, the place points into placeNames()
+        uint32_t distance;
+        uint32_t country;
+        boost::string_ref place;
+    };
+
+    // a chunk is split in two when it grows past this
+    static const size_t MAX_CHUNK = 128;
+
+    // One allocation holding the header and its columns, sized to fit
+    class Chunk
+    {
+    public:
+
+        static Chunk* create(const Entry* begin, const Entry* end);
+
+        static void operator delete(void* p)
+        {
+            ::operator delete(p);
+        }
+
+        size_t size() const { return d_size; }
+        Entry entry(size_t i) const;
+
+        // (visited_at, id) of the last entry
+        std::pair<uint32_t, uint32_t> back() const;
+
+        // position of the first entry not less than (visited_at, id)
+        size_t lower_bound(uint32_t visited_at, uint32_t id) const;
+
+        VisitWrap* const* visits() const
+        {
+            return reinterpret_cast<VisitWrap* const*>(this + 1);
+        }
+
+        const boost::string_ref* places() const
+        {
+            return reinterpret_cast<const boost::string_ref*>(visits() + d_size);
+        }
+
+        const uint32_t* visitedAt() const { return column<uint32_t>(0); }
+        const uint32_t* ids() const { return column<uint32_t>(1); }
+        const uint32_t* distances() const { return column<uint32_t>(2); }
+        const int32_t* birthDates() const { return column<int32_t>(3); }
+        const uint32_t* countries() const { return column<uint32_t>(4); }
+
+        const uint8_t* marks() const
+        {
+            return reinterpret_cast<const uint8_t*>(column<uint32_t>(5));
+        }
+
+        const char* genders() const
+        {
+            return reinterpret_cast<const char*>(marks() + d_size);
+        }
+
+    private:
+
+        explicit Chunk(size_t size)
+            : d_size(size) {}
+
+        // the 4 byte columns follow pointers and places, bytes come last
+        template <typename T>
+        const T* column(size_t i) const
+        {
+            return reinterpret_cast<const T*>(places() + d_size) + i * d_size;
+        }
+
+        template <typename T>
+        T* column(size_t i)
+        {
+            return const_cast<T*>(static_cast<const Chunk*>(this)->column<T>(i));
+        }
+
+        // pointer sized, so the pointer columns right after it are aligned
+        size_t d_size;
+    };
+
+    typedef std::vector<const Chunk*> ChunkList;
+
+    class iterator
+    {
+    public:
+
+        iterator(const ChunkList* chunks, size_t chunk, size_t pos)
+            : d_chunks(chunks), d_chunk(chunk), d_pos(pos) {}
+
+        VisitWrap* operator *() const
+        {
+            return (*d_chunks)[d_chunk]->visits()[d_pos];
+        }
+
+        iterator& operator ++()
+        {
+            if (++d_pos == (*d_chunks)[d_chunk]->size()) {
+                ++d_chunk;
+                d_pos = 0;
+            }
+            return *this;
+        }
+
+        bool operator ==(const iterator& other) const
+        {
+            return d_chunk == other.d_chunk && d_pos == other.d_pos;
+        }
+
+        bool operator !=(const iterator& other) const
+        {
+            return !(*this == other);
+        }
+
+        size_t chunk() const { return d_chunk; }
+        size_t pos() const { return d_pos; }
+
+    private:
+
+        const ChunkList* d_chunks;
+        size_t d_chunk;
+        size_t d_pos;
+    };
 
-    void add(VisitWrap* v);
-    void normalize();
-    void remove(uint32_t visit_id);
+    // snapshot of the list, valid while the reader stays in its epoch
+    class View
+    {
+    public:
+
+        explicit View(const ChunkList* chunks)
+            : d_chunks(chunks) {}
+
+        iterator begin() const { return iterator(d_chunks, 0, 0); }
+        iterator end() const { return iterator(d_chunks, d_chunks->size(), 0); }
+
+        // first visit with visited_at not less than given
+        iterator lower_bound(uint32_t visited_at) const;
+
+        // calls f(chunk, from, to) for the runs of entries with
+        // visited_at in [fromDate, untilDate)
+        template <typename F>
+        void scan(uint32_t fromDate, uint64_t untilDate, F f) const;
+
+    private:
+
+        const ChunkList* d_chunks;
+    };
+
+    OrderedVisits() {}
+    ~OrderedVisits();
+
+    View view() const;
+
+    void add(const Entry& entry);
+    void remove(uint32_t visited_at, uint32_t visit_id);
+
+    // replaces the entry with the same visited_at and id
+    void update(const Entry& entry);
+
+    // inserts several entries, copying the list and each chunk once
+    void add(std::vector<Entry>& entries);
+    size_t size() const;
+
+    // bulk loading: append in any order, then sort once
+    void append(const Entry& entry);
+    void finishAppend();
+
+private:
+
+    // never holds empty chunks
+    Versioned<ChunkList> d_chunks;
+
+    // appended while bulk loading, readers don't see it
+    std::unique_ptr<std::vector<Entry>> d_staged;
 };
 
-struct UserVisits
+template <typename F>
+void OrderedVisits::View::scan(uint32_t fromDate, uint64_t untilDate, F f) const
 {
-    User entity;
-    std::string json;
+    size_t ci = 0;
+    size_t from = 0;
+
+    if (fromDate) {
+        auto it = lower_bound(fromDate);
+        if (it == end())
+            return;
 
-    void getJson(boost::string_ref& ref) const {
-        ref = json;
+        ci = it.chunk();
+        from = it.pos();
     }
 
+    for (; ci < d_chunks->size(); ++ci, from = 0) {
+        const Chunk& c = *(*d_chunks)[ci];
+        const uint32_t* at = c.visitedAt();
+
+        size_t to = c.size();
+        if (at[to - 1] >= untilDate)
+            to = std::lower_bound(at + from, at + to, untilDate) - at;
+
+        if (from < to)
+            f(c, from, to);
+
+        if (to < c.size())
+            return;
+    }
+}
+
+struct UserVisits
+{
+    Versioned<EntityVersion<User>> current;
+
     // ordered by visited_at
     OrderedVisits visits;
 };
@@ -124,17 +363,18 @@ struct UserVisits
 
 struct LocationVisits
 {
-    Location entity;
-    std::string json;
-
-    void getJson(boost::string_ref& ref) const {
-        ref = json;
-    }
+    Versioned<EntityVersion<Location>> current;
 
     // ordered by visited_at
     OrderedVisits visits;
+
+    // built once the location gets hot, then kept in step with visits
+    AverageIndex average;
 };
 
+// Readers must hold an EpochGuard for as long as they use anything they
+// got from the database, including cached responses. Writers lock
+// striped mutexes of the entities they touch.
 class Database
 {
 public:
@@ -148,17 +388,37 @@ public:
     Database();
     ~Database();
     
+    // call before loading, avg index age keys depend on it
     void setNow(uint32_t timestamp);
-    void reserve(bool fullRun);
+
+    // visits created in between are ordered once, in parallel, when
+    // loading finishes. Queries must wait for finishBulkLoad(). Users and
+    // locations must be loaded before their visits: changes to them
+    // reach published list entries only, not the staged ones.
+    void beginBulkLoad();
+    void finishBulkLoad();
     void printStat();
 
+    uint32_t now() const
+    {
+        return d_now;
+    }
+
+    // Binary copy of all entities and interned strings, see snapshot.h.
+    // Loading one takes the place of setNow() and the JSON loader on an
+    // empty database, false if there is none, it does not check out or
+    // was made from data other than source.
+    bool saveSnapshot(const std::string& path, uint64_t source);
+    bool loadSnapshot(const std::string& path, uint64_t source);
+
     bool get(uint32_t id, User& user);
     bool get(uint32_t id, Location& location);
     bool get(uint32_t id, Visit& visit);
 
-    bool getUser(uint32_t id, boost::string_ref& res);
-    bool getLocation(uint32_t id, boost::string_ref& res);
-    bool getVisit(uint32_t id, boost::string_ref& res);
+    // pre-rendered GET responses
+    bool getUser(uint32_t id, const CachedResponse*& res);
+    bool getLocation(uint32_t id, const CachedResponse*& res);
+    bool getVisit(uint32_t id, const CachedResponse*& res);
 
     UpdateResult updateUser(uint32_t id, const rapidjson::Value& v);
     UpdateResult updateLocation(uint32_t id, const rapidjson::Value& v);
@@ -168,15 +428,48 @@ public:
     bool create(const Location& location);
     bool create(const Visit& visit);
 
+    // each user and location visit list is updated once for the batch,
+    // under the stripes of all visits, users and locations it touches
+    bool create(const std::vector<Visit>& visits);
+
     bool getVisits(uint32_t user, const VisitsQuery& q, std::vector<UserVisit>& visits);
     bool getAverage(uint32_t location, const AverageQuery& q, double& avg);
 
 private:
 
-    HybridHash<UserVisits> d_users;
-    HybridHash<LocationVisits> d_locations;
-    HybridHash<VisitWrap> d_visits;
+    // ages past this are answered by a scan
+    static const uint32_t MAX_AGE = 150;
+
+    int32_t ageKey(int32_t birth_date) const;
+    AverageIndex::Sample sample(const Visit& visit, const User& user) const;
+
+    // builds the avg index of a location that got hot, under its stripe
+    void indexLocation(LocationVisits& lv);
+    void publishUser(UserVisits& uv, const User& user);
+
+    template <typename Change>
+    UpdateResult publishLocation(LocationVisits& lv, uint32_t id, Change change);
+
+    IdIndex<UserVisits> d_users;
+    IdIndex<LocationVisits> d_locations;
+    IdIndex<VisitWrap> d_visits;
 
     uint32_t d_now;
+    // d_ageCuts[a] is the day number of d_now minus a years
+    std::vector<int32_t> d_ageCuts;
+    bool d_bulkLoad = false;
+
+    // One array for all tables, so a lower address always means a lower
+    // table (visits, users, locations) or a lower stripe in the table.
+    // Writers taking several stripes take them in address order.
+    enum LockTable { VisitLocks, UserLocks, LocationLocks };
+    static const size_t LOCK_STRIPES = 256;
+
+    std::mutex* stripe(LockTable table, uint32_t id)
+    {
+        return &d_locks[table * LOCK_STRIPES + id % LOCK_STRIPES];
+    }
+
+    std::mutex d_locks[3 * LOCK_STRIPES];
 };
 
@@ -0,0 +1,146 @@
+#include "epoch.h"
+
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// epoch a thread is reading in, 0 while it is outside any guard
+struct ThreadRecord
+{
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> inUse{true};
+    ThreadRecord* next = nullptr;
+};
+
+struct Retired
+{
+    void* ptr;
+    void (*deleter)(void*);
+    uint64_t epoch;
+};
+
+// a thread tries to reclaim after retiring this many objects
+const size_t COLLECT_BATCH = 64;
+
+std::atomic<uint64_t> globalEpoch{1};
+
+// records are never freed, exited threads leave theirs for reuse
+std::atomic<ThreadRecord*> records{nullptr};
+
+// retired objects left behind by exited threads
+std::mutex orphansMutex;
+std::vector<Retired> orphans;
+
+ThreadRecord* acquireRecord()
+{
+    for (auto r = records.load(std::memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (r->inUse.compare_exchange_strong(expected, true))
+            return r;
+    }
+
+    auto r = new ThreadRecord();
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r)) {}
+    return r;
+}
+
+// a reader in epoch e may still hold objects retired in e or later,
+// so everything retired before the oldest active epoch minus one is safe
+uint64_t tryAdvance()
+{
+    uint64_t current = globalEpoch.load(std::memory_order_seq_cst);
+
+    for (auto r = records.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t e = r->epoch.load(std::memory_order_seq_cst);
+        if (e != 0 && e != current)
+            return current;
+    }
+
+    globalEpoch.compare_exchange_strong(current, current + 1);
+    return globalEpoch.load(std::memory_order_seq_cst);
+}
+
+// frees items retired at least two epochs ago, keeps the rest
+void freeExpired(std::vector<Retired>& items, uint64_t current)
+{
+    size_t kept = 0;
+    for (auto& item: items) {
+        if (item.epoch + 2 <= current)
+            item.deleter(item.ptr);
+        else
+            items[kept++] = item;
+    }
+
+    items.resize(kept);
+}
+
+struct LocalState
+{
+    ThreadRecord* record = acquireRecord();
+    int depth = 0;
+    std::vector<Retired> retired;
+
+    ~LocalState()
+    {
+        Epoch::collect();
+
+        if (!retired.empty()) {
+            std::lock_guard<std::mutex> lk(orphansMutex);
+            orphans.insert(orphans.end(), retired.begin(), retired.end());
+        }
+
+        record->epoch.store(0, std::memory_order_release);
+        record->inUse.store(false, std::memory_order_release);
+    }
+};
+
+LocalState& local()
+{
+    static thread_local LocalState state;
+    return state;
+}
+
+} // namespace
+
+void Epoch::enter()
+{
+    auto& state = local();
+    if (state.depth++ > 0)
+        return;
+
+    state.record->epoch.store(globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // the epoch must be visible before any shared pointer is read
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Epoch::leave()
+{
+    auto& state = local();
+    if (--state.depth > 0)
+        return;
+
+    state.record->epoch.store(0, std::memory_order_release);
+}
+
+void Epoch::retire(void* p, void (*deleter)(void*))
+{
+    auto& state = local();
+    state.retired.push_back(Retired{p, deleter, globalEpoch.load(std::memory_order_seq_cst)});
+
+    if (state.retired.size() >= COLLECT_BATCH)
+        collect();
+}
+
+void Epoch::collect()
+{
+    auto& state = local();
+    uint64_t current = tryAdvance();
+
+    freeExpired(state.retired, current);
+
+    std::unique_lock<std::mutex> lk(orphansMutex, std::try_to_lock);
+    if (lk.owns_lock() && !orphans.empty())
+        freeExpired(orphans, current);
+}
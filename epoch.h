@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Epoch based reclamation. Readers run inside an EpochGuard and never
+// block. Writers unpublish an object and hand it to retire(), which
+// frees it once every thread that might still see it has left the
+// epoch it was retired in.
+class Epoch
+{
+public:
+
+    static void enter();
+    static void leave();
+
+    template <typename T>
+    static void retire(const T* p)
+    {
+        if (p)
+            retire(const_cast<T*>(p), [](void* v) { delete static_cast<T*>(v); });
+    }
+
+    static void retire(void* p, void (*deleter)(void*));
+
+    // tries to free what the calling thread has retired so far
+    static void collect();
+};
+
+class EpochGuard
+{
+public:
+
+    EpochGuard()
+    {
+        Epoch::enter();
+    }
+
+    ~EpochGuard()
+    {
+        Epoch::leave();
+    }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator =(const EpochGuard&) = delete;
+};
+
+// Pointer to the current immutable version of T. Readers load it inside
+// an EpochGuard, writers replace it and the old version gets retired.
+template <typename T>
+class Versioned
+{
+public:
+
+    Versioned() {}
+    Versioned(const Versioned&) = delete;
+    Versioned& operator =(const Versioned&) = delete;
+
+    ~Versioned()
+    {
+        delete d_current.load(std::memory_order_relaxed);
+    }
+
+    const T* get() const
+    {
+        return d_current.load(std::memory_order_acquire);
+    }
+
+    void publish(const T* next)
+    {
+        Epoch::retire(d_current.exchange(next, std::memory_order_acq_rel));
+    }
+
+private:
+
+    std::atomic<const T*> d_current{nullptr};
+};
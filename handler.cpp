@@ -1,5 +1,6 @@
 #include "handler.h"
 #include "database.h"
+#include "write_pipeline.h"
 
 #include <iostream>
 
@@ -142,11 +143,24 @@ bool parseAverageQuery(string_ref query, AverageQuery& aq)
 
 }
 
+const CachedResponse& emptyObjectResponse()
+{
+    static CachedResponse response = [] {
+        CachedResponse r;
+        r.render("{}");
+        return r;
+    }();
+
+    return response;
+}
+
 string_ref strNew("new");
 string_ref strUsers("users");
 string_ref strLocations("locations");
 string_ref strVisits("visits");
 string_ref strAvg("avg");
+string_ref strStats("stats");
+string_ref strAdmission("admission");
 
 Handler::Entity getEntityId(const boost::string_ref& entity)
 {
@@ -170,12 +184,32 @@ Handler::~Handler()
 {
 }
 
+void Handler::setAdmissionLimits(const AdmissionLimits& limits)
+{
+    d_admission.setLimits(limits);
+}
+
+void Handler::startWritePipeline()
+{
+    if (!d_pipeline)
+        d_pipeline.reset(new WritePipeline(d_db));
+}
+
+void Handler::finishWrite(int status, Response& response)
+{
+    response.clear();
+    if (status == 200)
+        response.cached = &emptyObjectResponse();
+}
+
 int Handler::handle(
     Method method, 
-    const std::string& body,
-    const std::string& path, 
-    const std::string& query, 
-    Response& response)
+    boost::string_ref body,
+    boost::string_ref path, 
+    boost::string_ref query, 
+    Response& response,
+    WriteCompletion* completion,
+    uint64_t receivedUs)
 {   
     boost::string_ref parts[4];
     size_t partCount = 0;
@@ -197,24 +231,38 @@ int Handler::handle(
 
     Entity entityId = getEntityId(entity);
     if (entityId == Entity::Unknown) {
+        if (method == Method::GET && partCount == 3 && entity == strStats && idStr == strAdmission)
+            return getAdmissionStats(response);
         return 400;
     }
 
-    if (method == Method::POST && idStr == strNew) {
-        std::lock_guard<std::mutex> lk(d_mutex);
+    // entity GETs are served pre-rendered and cost less than a 503,
+    // everything else has to get past admission control first
+    AdmissionController::Ticket ticket;
 
-        int result = 400;
+    if (method == Method::POST && idStr == strNew) {
+        if (!d_admission.admit(AdmissionController::EntityCreate, ticket, receivedUs))
+            return 503;
 
+        int status = 400;
         switch (entityId) {
         case Handler::Entity::User:
-            return createEntity<User>(body, response);
+            status = createEntity<User>(body, response, completion);
+            break;
         case Handler::Entity::Location:
-            return createEntity<Location>(body, response);
+            status = createEntity<Location>(body, response, completion);
+            break;
         case Handler::Entity::Visit:
-            return createEntity<Visit>(body, response);
+            status = createEntity<Visit>(body, response, completion);
+            break;
         default:
-            return 400;
+            break;
         }
+
+        // a queued write stays in flight until its status is delivered
+        if (status == PENDING)
+            completion->ticket = std::move(ticket);
+        return status;
     }
 
     int id = atoi(idStr.data());
@@ -223,10 +271,7 @@ int Handler::handle(
         // GET /entity/id
         if (method == Method::GET) {
             bool found = false;
-
-            boost::string_ref result(
-                    response.dataBuf.data(),
-                    response.dataBuf.size());
+            const CachedResponse* result = nullptr;
 
             switch (entityId) {
             case Handler::Entity::User:
@@ -243,38 +288,53 @@ int Handler::handle(
             }
 
             if (found) {
-                response.dataRef = result;
+                response.cached = result;
+                response.cachedTransient = true;
                 return 200;
             }
 
             return 404;
 
         } else if (method == Method::POST) {
+            if (!d_admission.admit(AdmissionController::EntityUpdate, ticket, receivedUs))
+                return 503;
+
+            if (d_pipeline && completion) {
+                std::unique_ptr<Mutation> m(new Mutation());
+                if (m->update.Parse(body.data(), body.length()).HasParseError())
+                    return 400;
+
+                m->entity = entityId;
+                m->id = id;
+                m->completion = completion;
+                // a queued write stays in flight until its status is delivered
+                completion->ticket = std::move(ticket);
+                d_pipeline->submit(m.release());
+                return PENDING;
+            }
+
             rapidjson::Document d;
             if (d.Parse(body.data(), body.length()).HasParseError())
                 return 400;
 
             Database::UpdateResult result = Database::UpdateResult::badData;
 
-            {
-                std::lock_guard<std::mutex> lk(d_mutex);
-                switch (entityId) {
-                case Handler::Entity::User:
-                    result = d_db.updateUser(id, d);
-                    break;
-                case Handler::Entity::Location:
-                    result = d_db.updateLocation(id, d);
-                    break;
-                case Handler::Entity::Visit:
-                    result = d_db.updateVisit(id, d);
-                    break;
-                default:
-                    return 400;
-                }
+            switch (entityId) {
+            case Handler::Entity::User:
+                result = d_db.updateUser(id, d);
+                break;
+            case Handler::Entity::Location:
+                result = d_db.updateLocation(id, d);
+                break;
+            case Handler::Entity::Visit:
+                result = d_db.updateVisit(id, d);
+                break;
+            default:
+                return 400;
             }
 
             if (result == Database::UpdateResult::ok) {
-                response.dataRef = "{}";
+                response.cached = &emptyObjectResponse();
             }
 
             switch (result) {
@@ -292,10 +352,14 @@ int Handler::handle(
     }
 
     if (parts[3] == strVisits && entityId == Entity::User) {
+        if (!d_admission.admit(AdmissionController::Visits, ticket, receivedUs))
+            return 503;
         return getVisits(id, query, response);
     }
 
     if (parts[3] == strAvg && entityId == Entity::Location) {
+        if (!d_admission.admit(AdmissionController::Average, ticket, receivedUs))
+            return 503;
         return getAverage(id, query, response);
     }
 
@@ -303,8 +367,26 @@ int Handler::handle(
     return 400;
 }
 
+void storeEntity(Mutation& m, const User& user)
+{
+    m.entity = Handler::Entity::User;
+    m.user = user;
+}
+
+void storeEntity(Mutation& m, const Location& location)
+{
+    m.entity = Handler::Entity::Location;
+    m.location = location;
+}
+
+void storeEntity(Mutation& m, const Visit& visit)
+{
+    m.entity = Handler::Entity::Visit;
+    m.visit = visit;
+}
+
 template <typename T>
-int Handler::createEntity(const std::string& json, Response& response)
+int Handler::createEntity(boost::string_ref json, Response& response, WriteCompletion* completion)
 {
     rapidjson::Document d;
     d.Parse(json.data(), json.length());
@@ -313,13 +395,22 @@ int Handler::createEntity(const std::string& json, Response& response)
     if (!entity.load(d))
         return 400;
 
+    if (d_pipeline && completion) {
+        std::unique_ptr<Mutation> m(new Mutation());
+        m->create = true;
+        storeEntity(*m, entity);
+        m->completion = completion;
+        d_pipeline->submit(m.release());
+        return PENDING;
+    }
+
     d_db.create(entity);
-    response.dataRef = "{}";
+    response.cached = &emptyObjectResponse();
 
     return 200;
 }
 
-int Handler::getAverage(uint32_t id, const std::string& query, Response& res)
+int Handler::getAverage(uint32_t id, boost::string_ref query, Response& res)
 {
     AverageQuery aq;
     if (!parseAverageQuery(query, aq))
@@ -344,6 +435,18 @@ int Handler::getAverage(uint32_t id, const std::string& query, Response& res)
 }
 
 
+int Handler::getAdmissionStats(Response& res)
+{
+    std::string stats = d_admission.stats();
+    if (stats.size() > res.dataBuf.size())
+        return 500;
+
+    memcpy(res.dataBuf.data(), stats.data(), stats.size());
+    res.useDataBuf(stats.size());
+    return 200;
+}
+
+
 static boost::string_ref visitRespPrefix("{ \"visits\" : [");
 static boost::string_ref visitRespSuffix("]}");
 
@@ -359,7 +462,7 @@ char* escape_json(char *p, const boost::string_ref& s) {
     return p;
 }
 
-int Handler::getVisits(uint32_t id, const std::string& query, Response& res)
+int Handler::getVisits(uint32_t id, boost::string_ref query, Response& res)
 {
     VisitsQuery vq;
     std::vector<UserVisit> visits;
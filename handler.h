@@ -1,11 +1,16 @@
 #pragma once
 
+#include <memory>
 #include <string>
-#include <mutex>
 #include <boost/utility/string_ref.hpp>
 #include <rapidjson/stringbuffer.h>
 
+#include "admission.h"
+#include "buffer_pool.h"
+#include "cached_response.h"
+
 class Database;
+class WritePipeline;
 
 enum class HttpStatus
 {
@@ -33,7 +38,13 @@ struct Response {
     HttpStatus code = HttpStatus::invalid;
     boost::string_ref contentType;
     boost::string_ref dataRef;
-    std::array<char, 4096*4> dataBuf;
+    // complete response, used instead of the fields above
+    const CachedResponse* cached = nullptr;
+    // cached belongs to an entity version and only lives as long as
+    // the reader epoch it was looked up in
+    bool cachedTransient = false;
+    // attached only while a dynamic body is being built or sent
+    PooledBuffer<4096*4> dataBuf;
 
     Response() {
         clear();
@@ -44,6 +55,9 @@ struct Response {
         contentType = "application/octet-stream";
         code = HttpStatus::invalid;
         dataRef.clear();
+        cached = nullptr;
+        cachedTransient = false;
+        dataBuf.release();
     }
 
     bool valid() const
@@ -71,6 +85,23 @@ struct Response {
     }
 };
 
+// Gets the status of a POST applied by the write pipeline. Called on the
+// writer thread, implementations pass it on to the connection's thread.
+class WriteCompletion
+{
+public:
+
+    virtual ~WriteCompletion() {}
+
+    virtual void completeWrite(int status) = 0;
+
+    // admission of the write in flight, released once its status is
+    // back on the connection
+    AdmissionController::Ticket ticket;
+};
+
+// Requests must be handled inside an EpochGuard, which the caller holds
+// until the response no longer refers to database memory.
 class Handler
 {
 public:
@@ -90,20 +121,36 @@ public:
     Handler(Database& db);
     ~Handler();
 
+    void setAdmissionLimits(const AdmissionLimits& limits);
+
+    // POSTs go to a writer thread from now on, for callers that can
+    // take their status later
+    void startWritePipeline();
+
+    // handle() result for a POST queued to the write pipeline
+    static const int PENDING = 0;
+
     int handle(Method method, 
-        const std::string& body,
-        const std::string& path, 
-        const std::string& query, 
-        Response& response);
+        boost::string_ref body,
+        boost::string_ref path, 
+        boost::string_ref query, 
+        Response& response,
+        WriteCompletion* completion = nullptr,
+        uint64_t receivedUs = 0);
+
+    // fills in the response for the status of a pipelined POST
+    void finishWrite(int status, Response& response);
 
 private:
 
     template <typename T>
-    int createEntity(const std::string& json, Response& response);
+    int createEntity(boost::string_ref json, Response& response, WriteCompletion* completion);
 
-    int getAverage(uint32_t id, const std::string& query, Response& response);
-    int getVisits(uint32_t id, const std::string& query, Response& response);
+    int getAverage(uint32_t id, boost::string_ref query, Response& response);
+    int getVisits(uint32_t id, boost::string_ref query, Response& response);
+    int getAdmissionStats(Response& response);
 
     Database& d_db;
-    std::mutex d_mutex;
+    AdmissionController d_admission;
+    std::unique_ptr<WritePipeline> d_pipeline;
 };
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Dense index of entities by 32 bit id: a two level directory of pages
+// allocated on demand. Pages never move once allocated, so lookups run
+// concurrently with inserts without locks or rehash pauses. A slot is
+// visible to find() only after publish(), which orders the writes that
+// filled it before any reader that sees it.
+template <typename T>
+class IdIndex
+{
+public:
+
+    static const unsigned PAGE_BITS = 12;
+    static const unsigned TABLE_BITS = 10;
+    static const unsigned DIR_BITS = 32 - PAGE_BITS - TABLE_BITS;
+
+    static const size_t PAGE_SIZE = size_t(1) << PAGE_BITS;
+    static const size_t TABLE_SIZE = size_t(1) << TABLE_BITS;
+    static const size_t DIR_SIZE = size_t(1) << DIR_BITS;
+
+    IdIndex()
+    {
+        for (auto& t: d_dir)
+            t.store(nullptr, std::memory_order_relaxed);
+    }
+
+    IdIndex(const IdIndex&) = delete;
+    IdIndex& operator =(const IdIndex&) = delete;
+
+    ~IdIndex()
+    {
+        for (auto& t: d_dir) {
+            Table* table = t.load(std::memory_order_relaxed);
+            if (!table)
+                continue;
+
+            for (auto& p: table->pages)
+                delete p.load(std::memory_order_relaxed);
+            delete table;
+        }
+    }
+
+    size_t size() const
+    {
+        return d_count.load(std::memory_order_relaxed);
+    }
+
+    // published entity or nullptr
+    T* find(uint32_t id) const
+    {
+        Page* page = findPage(id);
+        if (!page)
+            return nullptr;
+
+        size_t i = id & (PAGE_SIZE - 1);
+        uint64_t bits = page->used[i / 64].load(std::memory_order_acquire);
+        if (!(bits & (uint64_t(1) << (i % 64))))
+            return nullptr;
+
+        return &page->items[i];
+    }
+
+    T* end() const
+    {
+        return nullptr;
+    }
+
+    // slot of the id, allocated if needed but not published
+    T& at(uint32_t id)
+    {
+        Page* page = findPage(id);
+        if (!page)
+            page = allocatePage(id);
+
+        return page->items[id & (PAGE_SIZE - 1)];
+    }
+
+    T& operator [](uint32_t id)
+    {
+        return at(id);
+    }
+
+    // makes a filled slot visible to find()
+    void publish(uint32_t id)
+    {
+        Page* page = findPage(id);
+        size_t i = id & (PAGE_SIZE - 1);
+        uint64_t bit = uint64_t(1) << (i % 64);
+
+        uint64_t old = page->used[i / 64].fetch_or(bit, std::memory_order_release);
+        if (!(old & bit))
+            d_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // visits one of `slices` disjoint parts of the allocated pages,
+    // slots that were never published are visited too
+    template <typename F>
+    void forEachSlice(size_t slice, size_t slices, F f)
+    {
+        std::vector<Page*> pages;
+        for (auto& t: d_dir) {
+            Table* table = t.load(std::memory_order_acquire);
+            if (!table)
+                continue;
+
+            for (auto& p: table->pages) {
+                Page* page = p.load(std::memory_order_acquire);
+                if (page)
+                    pages.push_back(page);
+            }
+        }
+
+        size_t from = pages.size() * slice / slices;
+        size_t to = pages.size() * (slice + 1) / slices;
+
+        for (size_t i = from; i < to; ++i) {
+            for (auto& item: pages[i]->items)
+                f(item);
+        }
+    }
+
+private:
+
+    struct Page
+    {
+        T items[PAGE_SIZE];
+        std::atomic<uint64_t> used[PAGE_SIZE / 64];
+
+        Page()
+        {
+            for (auto& u: used)
+                u.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    struct Table
+    {
+        std::atomic<Page*> pages[TABLE_SIZE];
+
+        Table()
+        {
+            for (auto& p: pages)
+                p.store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    Page* findPage(uint32_t id) const
+    {
+        Table* table = d_dir[id >> (PAGE_BITS + TABLE_BITS)].load(std::memory_order_acquire);
+        if (!table)
+            return nullptr;
+
+        return table->pages[(id >> PAGE_BITS) & (TABLE_SIZE - 1)].load(std::memory_order_acquire);
+    }
+
+    Page* allocatePage(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lk(d_growMutex);
+
+        auto& tableRef = d_dir[id >> (PAGE_BITS + TABLE_BITS)];
+        Table* table = tableRef.load(std::memory_order_relaxed);
+        if (!table) {
+            table = new Table();
+            tableRef.store(table, std::memory_order_release);
+        }
+
+        auto& pageRef = table->pages[(id >> PAGE_BITS) & (TABLE_SIZE - 1)];
+        Page* page = pageRef.load(std::memory_order_relaxed);
+        if (!page) {
+            page = new Page();
+            pageRef.store(page, std::memory_order_release);
+        }
+
+        return page;
+    }
+
+    std::atomic<Table*> d_dir[DIR_SIZE];
+    std::atomic<size_t> d_count{0};
+    std::mutex d_growMutex;
+};
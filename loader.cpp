@@ -1,15 +1,23 @@
 #include "loader.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <future>
+#include <sstream>
+#include <thread>
 
-#include <rapidjson/document.h>
-#include <rapidjson/filereadstream.h>
-#include <rapidjson/istreamwrapper.h>
+#include <rapidjson/memorystream.h>
+#include <rapidjson/reader.h>
 
-#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 void printMemStat()
 {
@@ -18,6 +26,284 @@ void printMemStat()
     printf("Max rss: %zu MB\n", ru.ru_maxrss/1024);
 }
 
+namespace {
+
+// Read-only mapping of a whole file, pages stay shared with the page cache.
+class MappedFile
+{
+public:
+
+    explicit MappedFile(const std::string& filename)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            d_opened = true;
+            d_size = st.st_size;
+        }
+
+        if (d_size) {
+            void* data = mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, d_size, MADV_SEQUENTIAL);
+                d_data = static_cast<const char*>(data);
+            } else {
+                perror("mmap");
+                d_opened = false;
+            }
+        }
+
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (d_data)
+            munmap(const_cast<char*>(d_data), d_size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool opened() const { return d_opened; }
+    const char* data() const { return d_data; }
+    size_t size() const { return d_size; }
+
+private:
+
+    bool d_opened = false;
+    const char* d_data = nullptr;
+    size_t d_size = 0;
+};
+
+// SAX handler for {"users": [{...}, ...]} and alike. Members of each
+// object go straight into a User, Location or Visit, which is created
+// when the object closes. Unknown keys and nested values are skipped.
+class EntityReader
+{
+public:
+
+    explicit EntityReader(Database& db)
+        : d_db(db) {}
+
+    bool StartObject()
+    {
+        if (++d_depth == ENTITY_DEPTH) {
+            d_user = User();
+            d_location = Location();
+            d_visit = Visit();
+        }
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType)
+    {
+        if (d_depth-- == ENTITY_DEPTH) {
+            switch (d_kind) {
+            case Users: d_db.create(d_user); break;
+            case Locations: d_db.create(d_location); break;
+            case Visits: d_db.create(d_visit); break;
+            case Unknown: break;
+            }
+        }
+        return true;
+    }
+
+    bool StartArray()
+    {
+        ++d_depth;
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType)
+    {
+        --d_depth;
+        return true;
+    }
+
+    bool Key(const char* str, rapidjson::SizeType length, bool)
+    {
+        boost::string_ref key(str, length);
+
+        if (d_depth == 1) {
+            d_kind = key == "users" ? Users
+                : key == "locations" ? Locations
+                : key == "visits" ? Visits
+                : Unknown;
+        } else if (d_depth == ENTITY_DEPTH) {
+            d_field = field(key);
+        }
+        return true;
+    }
+
+    bool Int(int value)
+    {
+        if (d_depth != ENTITY_DEPTH)
+            return true;
+
+        switch (d_field) {
+        case Id:
+            d_user.id = d_location.id = d_visit.id = value;
+            break;
+        case BirthDate: d_user.birth_date = value; break;
+        case Distance: d_location.distance = value; break;
+        case LocationId: d_visit.location = value; break;
+        case UserId: d_visit.user = value; break;
+        case VisitedAt: d_visit.visited_at = value; break;
+        case Mark: d_visit.mark = value; break;
+        default: break;
+        }
+        return true;
+    }
+
+    // only values fitting int are taken, as Value::IsInt() did
+    bool Uint(unsigned value)
+    {
+        return value <= unsigned(INT32_MAX) ? Int(value) : true;
+    }
+
+    bool String(const char* str, rapidjson::SizeType length, bool)
+    {
+        if (d_depth != ENTITY_DEPTH)
+            return true;
+
+        boost::string_ref value(str, length);
+
+        switch (d_field) {
+        case Email: d_user.email.assign(str, length); break;
+        case FirstName: d_user.first_name.assign(str, length); break;
+        case LastName: d_user.last_name.assign(str, length); break;
+        case Gender:
+            if (length == 1)
+                d_user.gender = str[0];
+            break;
+        case Place: d_location.place = placeNames().intern(value); break;
+        case Country: d_location.country = countryNames().intern(value); break;
+        case City: d_location.city = cityNames().intern(value); break;
+        default: break;
+        }
+        return true;
+    }
+
+    bool Null() { return true; }
+    bool Bool(bool) { return true; }
+    bool Int64(int64_t) { return true; }
+    bool Uint64(uint64_t) { return true; }
+    bool Double(double) { return true; }
+    bool RawNumber(const char*, rapidjson::SizeType, bool) { return true; }
+
+private:
+
+    // root object, array of the kind, entity
+    static const int ENTITY_DEPTH = 3;
+
+    enum Kind { Unknown, Users, Locations, Visits };
+
+    enum Field {
+        None, Id, Email, FirstName, LastName, Gender, BirthDate,
+        Place, Country, City, Distance, LocationId, UserId, VisitedAt, Mark
+    };
+
+    Field field(boost::string_ref key) const
+    {
+        if (key == "id")
+            return Id;
+
+        switch (d_kind) {
+        case Users:
+            return key == "email" ? Email
+                : key == "first_name" ? FirstName
+                : key == "last_name" ? LastName
+                : key == "gender" ? Gender
+                : key == "birth_date" ? BirthDate
+                : None;
+        case Locations:
+            return key == "place" ? Place
+                : key == "country" ? Country
+                : key == "city" ? City
+                : key == "distance" ? Distance
+                : None;
+        case Visits:
+            return key == "location" ? LocationId
+                : key == "user" ? UserId
+                : key == "visited_at" ? VisitedAt
+                : key == "mark" ? Mark
+                : None;
+        case Unknown:
+            break;
+        }
+        return None;
+    }
+
+    Database& d_db;
+
+    int d_depth = 0;
+    Kind d_kind = Unknown;
+    Field d_field = None;
+
+    User d_user;
+    Location d_location;
+    Visit d_visit;
+};
+
+// path without folders
+boost::string_ref baseName(const std::string& path)
+{
+    auto slash = path.rfind('/');
+    boost::string_ref name(path);
+    if (slash != std::string::npos)
+        name.remove_prefix(slash + 1);
+    return name;
+}
+
+template <typename Stream>
+bool parse(Database& db, Stream& stream, const std::string& name)
+{
+    using namespace rapidjson;
+
+    EntityReader handler(db);
+    Reader reader;
+
+    ParseResult result = reader.Parse<kParseStopWhenDoneFlag>(stream, handler);
+    if (result.IsError()) {
+        fprintf(stderr, "%s: parse error %d at offset %zu\n", name.c_str(),
+                int(result.Code()), result.Offset());
+        return false;
+    }
+
+    return true;
+}
+
+// runs f(0)..f(count - 1) on up to one thread per core, false if any
+// of them returned false
+template <typename F>
+bool parallelFor(size_t count, F f)
+{
+    size_t threadsCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), count);
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < threadsCount; ++i) {
+        threads.emplace_back([count, &f, &next, &ok] {
+            for (size_t k; (k = next++) < count; ) {
+                if (!f(k))
+                    ok = false;
+            }
+        });
+    }
+
+    for (auto& t: threads)
+        t.join();
+
+    return ok;
+}
+
+} // namespace
+
 Loader::Loader(Database & db)
 : d_db(db)
 {
@@ -27,90 +313,199 @@ Loader::~Loader()
 {
 }
 
-void Loader::loadDirectory(const std::string& dir)
+bool Loader::isArchive(const std::string& source)
+{
+    struct stat st;
+    return stat(source.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool Loader::load(const std::string& source)
+{
+    if (isArchive(source))
+        return loadArchive(source);
+
+    return loadDirectory(source);
+}
+
+bool Loader::readNow(const std::string& source, uint32_t& now)
+{
+    std::string dir = source;
+    std::string text;
+
+    if (isArchive(source)) {
+        ZipArchive zip;
+        if (zip.open(source)) {
+            for (const auto& member: zip.members()) {
+                if (baseName(member.name) == "options.txt") {
+                    zip.read(member, text);
+                    break;
+                }
+            }
+        }
+
+        auto slash = source.rfind('/');
+        dir = slash == std::string::npos ? "." : source.substr(0, slash);
+    }
+
+    if (text.empty()) {
+        std::ifstream ifs(dir + "/options.txt");
+        text.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    }
+
+    std::istringstream is(text);
+    return bool(is >> now);
+}
+
+uint64_t Loader::fingerprint(const std::string& source, uint32_t now)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](const void* data, size_t size) {
+        auto p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            h ^= p[i];
+            h *= 1099511628211ull;
+        }
+    };
+
+    std::vector<std::string> files;
+    if (isArchive(source)) {
+        files.push_back(source);
+    } else {
+        for (const char* kind: {"/users_", "/locations_", "/visits_"}) {
+            auto found = findFiles(source + kind);
+            files.insert(files.end(), found.begin(), found.end());
+        }
+    }
+
+    for (const auto& file: files) {
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0)
+            continue;
+
+        int64_t attrs[3] = {int64_t(st.st_size), int64_t(st.st_mtim.tv_sec), int64_t(st.st_mtim.tv_nsec)};
+        mix(file.data(), file.size() + 1);
+        mix(attrs, sizeof(attrs));
+    }
+
+    mix(&now, sizeof(now));
+    return h;
+}
+
+bool Loader::loadDirectory(const std::string& dir)
 {
     printMemStat();
-    auto users = std::async(std::launch::async, [this, dir] { loadAll(dir + "/users_"); });
-    auto locations = std::async(std::launch::async, [this, dir] { loadAll(dir + "/locations_"); });
 
-    users.get();
-    locations.get();
+    // visits refer to both, they go after all users and locations
+    auto files = listFiles(dir + "/users_");
+    auto locations = listFiles(dir + "/locations_");
+    files.insert(files.end(), locations.begin(), locations.end());
+    if (!loadFiles(files))
+        return false;
 
     printMemStat();
 
-    loadAll(dir + "/visits_");
+    d_db.beginBulkLoad();
+    bool ok = loadFiles(listFiles(dir + "/visits_"));
+    d_db.finishBulkLoad();
     printMemStat();
 
     d_db.printStat();
+    return ok;
 }
 
+std::vector<std::string> Loader::findFiles(const std::string& basePattern)
+{
+    std::vector<std::string> files;
+    for (int i = 1;; ++i) {
+        std::string filename = basePattern + std::to_string(i) + ".json";
+        if (access(filename.c_str(), R_OK) != 0)
+            break;
+        files.push_back(filename);
+    }
 
-void Loader::loadAll(const std::string& basePattern)
+    return files;
+}
+
+std::vector<std::string> Loader::listFiles(const std::string& basePattern)
 {
-    std::cout << "Loading pattern " << basePattern << std::endl;
-    int i = 1;
-    while (loadFile(basePattern + std::to_string(i) + ".json"))
-        ++i;
+    auto files = findFiles(basePattern);
+    std::cout << "Loading pattern " << basePattern << ": " << files.size() << " files" << std::endl;
+    return files;
+}
+
+bool Loader::loadFiles(const std::vector<std::string>& files)
+{
+    return parallelFor(files.size(), [this, &files](size_t i) { return loadFile(files[i]); });
 }
 
 bool Loader::loadFile(const std::string & filename)
 {
-    using namespace rapidjson;
+    MappedFile file(filename);
+    if (!file.opened())
+        return false;
 
-    std::ifstream ifs(filename);
+    rapidjson::MemoryStream stream(file.data(), file.size());
+    return parse(d_db, stream, filename);
+}
 
-    if (!ifs) {
+bool Loader::loadArchive(const std::string& path)
+{
+    ZipArchive zip;
+    if (!zip.open(path))
         return false;
-    }
 
-    IStreamWrapper isw(ifs);
-    Document d;
-    d.ParseStream(isw);
+    printMemStat();
 
-    if (d.HasMember("locations")) {
-        if (!parseLocations(d["locations"])) {
-            return false;
-        }
-    } 
-    
-    if (d.HasMember("visits")) {
-        if (!parseVisits(d["visits"])) {
-            return false;
-        }
-    } 
-    
-    if (d.HasMember("users")) {
-        if (!parseUsers(d["users"])) {
-            return false;
-        }
-    }
+    // same order as for a directory, each member is inflated by the
+    // thread parsing it
+    auto members = listMembers(zip, "users_");
+    auto locations = listMembers(zip, "locations_");
+    members.insert(members.end(), locations.begin(), locations.end());
+    if (!loadMembers(members))
+        return false;
 
-    return true;
+    printMemStat();
+
+    d_db.beginBulkLoad();
+    bool ok = loadMembers(listMembers(zip, "visits_"));
+    d_db.finishBulkLoad();
+    printMemStat();
+
+    d_db.printStat();
+    return ok;
 }
 
-template <typename T>
-bool loadItems(Database& db, const rapidjson::Value& v)
+std::vector<const ZipArchive::Member*> Loader::listMembers(const ZipArchive& zip, const std::string& prefix)
 {
-    for (const auto& item : v.GetArray()) {
-        T entity;
-        entity.load(item);
-        db.create(entity);
+    std::vector<const ZipArchive::Member*> members;
+
+    for (const auto& member: zip.members()) {
+        boost::string_ref name = baseName(member.name);
+        if (!name.starts_with(prefix) || !name.ends_with(".json"))
+            continue;
+
+        name.remove_prefix(prefix.size());
+        name.remove_suffix(5);
+        if (!name.empty() && std::all_of(name.begin(), name.end(), ::isdigit))
+            members.push_back(&member);
     }
 
-    return true;
+    std::cout << "Loading members " << prefix << ": " << members.size() << " files" << std::endl;
+    return members;
 }
 
-bool Loader::parseLocations(const rapidjson::Value& v)
+bool Loader::loadMembers(const std::vector<const ZipArchive::Member*>& members)
 {
-    return loadItems<Location>(d_db, v);
-}
+    return parallelFor(members.size(), [this, &members](size_t i) {
+        const auto& member = *members[i];
+        ZipMemberStream stream(member);
 
-bool Loader::parseUsers(const rapidjson::Value& v)
-{
-    return loadItems<User>(d_db, v);
-}
+        // a parse error is reported by parse() itself
+        bool parsed = parse(d_db, stream, member.name);
+        if (stream.failed())
+            fprintf(stderr, "%s: broken compressed data\n", member.name.c_str());
 
-bool Loader::parseVisits(const rapidjson::Value& v)
-{
-    return loadItems<Visit>(d_db, v);
+        return parsed && !stream.failed();
+    });
 }
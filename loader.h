@@ -1,25 +1,50 @@
 #pragma once
 
 #include "database.h"
-#include <rapidjson/document.h>
+#include "zip_archive.h"
 
+#include <string>
+#include <vector>
+
+// Fills the database from users_N.json, locations_N.json and visits_N.json,
+// either extracted into a directory or members of data.zip. Files are
+// parsed with a SAX reader straight into entities, files of the same
+// kind load in parallel.
 class Loader
 {
 public:
     Loader(Database& db);
     ~Loader();
 
+    // source is a directory or a zip archive, false if any file failed
+    // to load, the database then holds whatever was read
+    bool load(const std::string& source);
+
     bool loadFile(const std::string& filename);
-    void loadDirectory(const std::string& dir);
+    bool loadDirectory(const std::string& dir);
+    bool loadArchive(const std::string& path);
+
+    // current time from options.txt: inside the archive, next to it
+    // or in the directory
+    static bool readNow(const std::string& source, uint32_t& now);
+
+    // identifies the dataset a snapshot was made from: paths, sizes and
+    // modification times of the archive or the data files, and now
+    static uint64_t fingerprint(const std::string& source, uint32_t now);
 
 private:
 
-    void loadAll(const std::string& basePattern);
+    static bool isArchive(const std::string& source);
 
-    bool parseLocations(const rapidjson::Value& v);
-    bool parseUsers(const rapidjson::Value& v);
-    bool parseVisits(const rapidjson::Value& v);
+    // basePattern + "1.json", basePattern + "2.json"... while they exist
+    static std::vector<std::string> listFiles(const std::string& basePattern);
+    static std::vector<std::string> findFiles(const std::string& basePattern);
+
+    // members named prefix + "N.json" in any folder
+    static std::vector<const ZipArchive::Member*> listMembers(const ZipArchive& zip, const std::string& prefix);
+
+    bool loadFiles(const std::vector<std::string>& files);
+    bool loadMembers(const std::vector<const ZipArchive::Member*>& members);
 
     Database& d_db;
 };
-
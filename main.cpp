@@ -3,13 +3,53 @@
 #include "handler.h"
 #include "connection.h"
 #include "server_epoll.h"
+#ifdef HAVE_IO_URING
+#include "server_uring.h"
+#endif
 
 #include <thread>
-#include <fstream>
 
 #define DEFAULT_PORT 80
 #define DEFAULT_BACKLOG 1000
 
+// server tunables are passed as name=value after the mode argument
+bool parseServerOption(ServerOptions& options, AdmissionLimits& limits, const std::string& arg)
+{
+    auto eq = arg.find('=');
+    if (eq == std::string::npos)
+        return false;
+
+    std::string name = arg.substr(0, eq);
+    int value = atoi(arg.c_str() + eq + 1);
+
+    if (name == "affinity")
+        options.pinThreads = value != 0;
+    else if (name == "events")
+        options.maxEvents = value;
+    else if (name == "busypoll")
+        options.busyPoll = value;
+    else if (name == "spin")
+        options.spinCount = value;
+    else if (name == "idle")
+        options.idleTimeout = value;
+    else if (name == "reqtimeout")
+        options.requestTimeout = value;
+    else if (name == "maxreq")
+        options.maxRequests = value;
+    else if (name == "writer")
+        options.asyncWrites = value != 0;
+    else if (name == "shedinflight")
+        limits.maxInflightUs = value;
+    else if (name == "shedlatency")
+        limits.maxLatencyUs = value;
+    else if (name == "shedqueue")
+        limits.maxQueueUs = value;
+    else
+        return false;
+
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     short port = DEFAULT_PORT;
@@ -23,27 +63,100 @@ int main(int argc, char **argv)
 
     if (argc > 3)
         threadsCount = atoi(argv[3]);
+
+    // e - shared epoll, r - epoll reactor per thread, u - io_uring
+    ServerOptions options;
+    AdmissionLimits limits;
+    char mode = argc > 4 ? argv[4][0] : 'e';
+    options.reactorPerThread = mode == 'r';
+
+#ifndef HAVE_IO_URING
+    if (mode == 'u') {
+        std::cerr << "Built without io_uring support" << std::endl;
+        return 1;
+    }
+#endif
+
+    // snapshot=path starts from the snapshot when it is there and
+    // writes one after loading the data when it is not
+    std::string snapshot;
+
+    for (int i = 5; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 9, "snapshot=") == 0) {
+            snapshot = arg.substr(9);
+            continue;
+        }
+
+        if (!parseServerOption(options, limits, argv[i])) {
+            std::cerr << "Invalid option: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
     
-    std::ifstream ofs(std::string(argv[1]) + "/options.txt");
-    uint32_t now;
-    uint32_t isfull = 0;
+    // argv[1] is a directory with extracted data or data.zip itself
+    uint32_t now = 0;
+    if (!Loader::readNow(argv[1], now))
+        std::cerr << "No timestamp in options.txt" << std::endl;
 
-    ofs >> now >> isfull;
+    // a snapshot only stands in for the very data it was made from
+    uint64_t source = snapshot.empty() ? 0 : Loader::fingerprint(argv[1], now);
 
     Database db;
-    db.reserve(isfull != 0);
+    bool restored = !snapshot.empty() && db.loadSnapshot(snapshot, source);
 
     Handler handler(db);
-    Loader loader(db);
-    loader.loadDirectory(argv[1]);
+    handler.setAdmissionLimits(limits);
+
+    // completions need a reactor that owns its connections
+    if (options.asyncWrites && mode != 'r') {
+        std::cerr << "Write pipeline needs reactor mode, ignored" << std::endl;
+        options.asyncWrites = false;
+    }
+
+    if (!restored) {
+        // age filters of the avg index are relative to it
+        db.setNow(now);
+
+        Loader loader(db);
+        // a partial dataset is neither served nor saved
+        if (!loader.load(argv[1])) {
+            std::cerr << "Failed to load " << argv[1] << std::endl;
+            return 1;
+        }
+
+        if (!snapshot.empty())
+            db.saveSnapshot(snapshot, source);
+    }
 
     std::cout << "Using port " << port << std::endl;
     std::cout << "Threads: " << threadsCount << std::endl;
-    std::cout << "Timestamp: " << now << std::endl;
-    
-    db.setNow(now);
+    std::cout << "Timestamp: " << db.now() << std::endl;
+    std::cout << "Mode: " << (mode == 'u' ? "io_uring" : 
+            options.reactorPerThread ? "reactor per thread" : "shared epoll") << std::endl;
+    std::cout << "Events per wait: " << options.maxEvents 
+        << ", busy poll: " << options.busyPoll 
+        << ", spin: " << options.spinCount << std::endl;
+    std::cout << "Idle timeout: " << options.idleTimeout
+        << "s, request timeout: " << options.requestTimeout
+        << "s, max requests: " << options.maxRequests << std::endl;
+    std::cout << "Shed at in-flight: " << limits.maxInflightUs
+        << "us, latency: " << limits.maxLatencyUs
+        << "us, queue: " << limits.maxQueueUs << "us" << std::endl;
+    std::cout << "Write pipeline: " << (options.asyncWrites ? "on" : "off") << std::endl;
+
+    if (options.asyncWrites)
+        handler.startWritePipeline();
+
+#ifdef HAVE_IO_URING
+    if (mode == 'u') {
+        ServerUring server(port, handler, options);
+        server.run(threadsCount);
+        return 0;
+    }
+#endif
 
-    ServerEpoll server(port, handler);
+    ServerEpoll server(port, handler, options);
     server.run(threadsCount);
 
     return 0;
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+
+// Intrusive multi-producer single-consumer queue, T needs a `T* next`.
+// Producers push onto a lock-free stack, the consumer takes the whole
+// stack with one exchange and reverses it into arrival order.
+template <typename T>
+class MpscQueue
+{
+public:
+
+    // true if the queue was empty, the consumer may need a wakeup
+    bool push(T* item)
+    {
+        T* head = d_head.load(std::memory_order_relaxed);
+        do {
+            item->next = head;
+        } while (!d_head.compare_exchange_weak(head, item,
+                    std::memory_order_release, std::memory_order_relaxed));
+
+        return head == nullptr;
+    }
+
+    // everything queued so far, oldest first
+    T* popAll()
+    {
+        T* item = d_head.exchange(nullptr, std::memory_order_acquire);
+
+        T* fifo = nullptr;
+        while (item) {
+            T* next = item->next;
+            item->next = fifo;
+            fifo = item;
+            item = next;
+        }
+
+        return fifo;
+    }
+
+    bool empty() const
+    {
+        return d_head.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+
+    std::atomic<T*> d_head{nullptr};
+};
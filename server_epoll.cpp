@@ -8,20 +8,25 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/syscall.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
 #include <sched.h>
 
+#include <algorithm>
 #include <array>
 #include <functional>
 #include <list>
+#include <memory>
 #include <thread>
-
-#include <boost/pool/object_pool.hpp>
+#include <vector>
 
 #include "connection.h"
+#include "mpsc_queue.h"
+#include "slab_pool.h"
+#include "timer_wheel.h"
 
 int make_socket_non_blocking (int sfd) 
 {
@@ -86,7 +91,10 @@ int set_thread_affinity(int cpu)
     CPU_SET(cpu, &set);
     if (sched_setaffinity( gettid(), sizeof( cpu_set_t ), &set )) {
         perror( "sched_setaffinity" );
+        return -1;
     }
+
+    return 0;
 }
 
 struct EpollHandler 
@@ -122,25 +130,47 @@ struct EpollHandler
     }
 };
 
-struct EpollConnection: public EpollHandler, public ConnectionBase
+// timer wheel of a reactor thread, timeouts are in ticks
+struct ConnectionTimeouts
+{
+    TimerWheel wheel;
+    uint64_t idle = 0;
+    uint64_t request = 0;
+};
+
+struct CompletionMailbox;
+
+struct EpollConnection: public EpollHandler, public ConnectionBase, public TimerNode, 
+    public WriteCompletion
 {
     int efd;
-    std::array<char, 8192> readBuf;
+    // taken from the pool for the duration of a read burst
+    PooledBuffer<READ_BUF_SIZE> readBuf;
     bool addedToEpoll;
-    std::array<iovec, 100> writeBufs;
-    size_t writeIndex;
-    size_t writeIoCount;
     bool watching = false;
+    // re-arm after every event (shared epoll) or stay registered for life
+    bool oneShot;
+    // events of the lifelong registration, EPOLLOUT only while a write
+    // is short
+    uint32_t registered = 0;
+    // socket read up to EAGAIN and armed
+    bool drained = false;
+    // nesting of event handling, close() defers destruction while set
+    int busy = 0;
+    // one-shot re-arm requested while handling an event
+    uint32_t armEvents = 0;
+    // set in reactor mode only
+    ConnectionTimeouts* timeouts = nullptr;
+    CompletionMailbox* mailbox = nullptr;
 
     std::function<void()> onClose;
 
-    EpollConnection(int fd, int epollfd, Handler& handler) : 
+    EpollConnection(int fd, int epollfd, Handler& handler, bool oneshot = true) : 
         EpollHandler(fd), 
         ConnectionBase(handler),
         efd(epollfd),
         addedToEpoll(false),
-        writeIndex(0),
-        writeIoCount(0)
+        oneShot(oneshot)
     {
         int i = 1;
         // don't let inactive sockets die
@@ -154,48 +184,94 @@ struct EpollConnection: public EpollHandler, public ConnectionBase
 
     void add(uint32_t events = EPOLLIN)
     {
-        epoll_event ev;
-        ev.events = events | EPOLLET | EPOLLONESHOT;
-        ev.data.ptr = this;
-        int action = watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-
-        if (epoll_ctl(efd, action, fd, &ev) < 0) {
-            fprintf(stderr, "epoll_ctl error: fd=%d\n", fd);
+        // persistent registration always has input, edge triggered it
+        // needs no re-arming
+        if (!oneShot) {
+            events |= EPOLLIN;
+            if (watching && events == registered)
+                return;
+        } else if (busy) {
+            // once re-armed the next event may already run on another
+            // thread, handleEvent arms on its way out
+            armEvents = events;
             return;
         }
 
+        arm(events);
+    }
+
+    // in one-shot mode nothing of ours may be touched after this
+    void arm(uint32_t events)
+    {
+        int epollfd = efd;
+        int sock = fd;
+        int action = watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
         watching = true;
+        registered = events;
+
+        epoll_event ev;
+        ev.events = events | EPOLLET | (oneShot ? EPOLLONESHOT : 0);
+        ev.data.ptr = this;
+
+        if (epoll_ctl(epollfd, action, sock, &ev) < 0)
+            fprintf(stderr, "epoll_ctl error: fd=%d\n", sock);
+    }
+
+    void waitInput()
+    {
+        drained = true;
+        add();
     }
 
     virtual void startRead() override
     {
-        ssize_t rc = read(fd, readBuf.data(), readBuf.size());
+        drained = false;
+        bool wait = readInput();
 
-        // fprintf(stderr, "read: rc=%zd\n", rc);
+        // whatever is left of a request has been copied by now, and the
+        // buffer must be back in the pool before re-arming lets another
+        // thread read into it
+        readBuf.release();
+
+        if (wait)
+            waitInput();
+    }
+
+    // true when the socket is empty and input must be waited for
+    bool readInput()
+    {
+        // a pipelined batch or a request body may take several reads
+        while (fd != -1 && !drained && writeIoCount == 0 && !d_writePending) {
+            ssize_t rc = read(fd, readBuf.data(), readBuf.size());
+
+            // fprintf(stderr, "read: rc=%zd\n", rc);
+
+            if (rc == -1) {
+                if (errno == EAGAIN) {
+                    // fprintf(stderr, "No data on start...\n");
+                    return true;
+                }
 
-        if (rc == -1) {
-            if (errno == EAGAIN) {
-                add();
-                // fprintf(stderr, "No data on start...\n");
-            } else {
                 if (errno != 104)
                    fprintf(stderr, "read error: %d\n", errno);
                 close();
+                return false;
             }
 
-            return;
-        }
+            if (rc == 0) {
+                close();
+                return false;
+            }
 
-        if (rc == 0) {
-            close();
-            return;
-        }
+            uv_buf_t buf{readBuf.data(), readBuf.size()};
+            onRead(rc, &buf);
 
-        uv_buf_t buf{readBuf.data(), readBuf.size()};
-        onRead(rc, &buf);
+            // short read emptied the socket, no need to hit EAGAIN
+            if (size_t(rc) < readBuf.size() && fd != -1 && !drained && writeIoCount == 0 && !d_writePending)
+                return true;
+        }
 
-        // fprintf(stderr, "read %zd bytes, sending reply\n", rc);
-        // write(reply, sizeof(reply));
+        return false;
     }
     
     void startWrite()
@@ -211,7 +287,9 @@ struct EpollConnection: public EpollHandler, public ConnectionBase
         if (rc == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 fprintf(stderr, "Write will block\n");
-                add(EPOLLOUT | EPOLLIN);
+                // input waits until the queued responses are out
+                stabilizeWrites();
+                add(EPOLLOUT);
             } else {
                 fprintf(stderr, "write error: %d\n", errno);
                 close();
@@ -220,28 +298,18 @@ struct EpollConnection: public EpollHandler, public ConnectionBase
         }
 
         // update buffer pointers
-        
-        while (rc > 0) {
-            auto bufp = (uv_buf_t*)(&writeBufs[writeIndex]);
-
-            if (bufp->len > rc) {
-                bufp->len -= rc;
-                bufp->base += rc;
-                break;
-            }
-            
-            rc -= bufp->len;
-            ++writeIndex;
-            --writeIoCount;
-        }
+        consumeWritten(rc);
 
         if (writeIoCount == 0) {
-            writeIndex = 0;
             // fprintf(stderr, "Write completed, %zd bytes sent\n", rc);
+            // no more wakeups for every drained send buffer
+            if (!oneShot && (registered & EPOLLOUT))
+                add(EPOLLIN);
             onWriteComplete();
         } else {
-            // partial write
-            add(EPOLLOUT | EPOLLIN);
+            // partial write, the rest outlives the reader epoch
+            stabilizeWrites();
+            add(EPOLLOUT);
         }
     }
 
@@ -252,12 +320,80 @@ struct EpollConnection: public EpollHandler, public ConnectionBase
         // fprintf(stderr, "Write index=%d, ioc=%d\n", writeIndex, writeIoCount);
         if (fd != -1) {
             EpollHandler::close();
-            if (onClose)
+            if (!busy && !d_writePending && onClose)
                 onClose();
         }
     }
 
     virtual void handleEvent(int efd, uint32_t events) override
+    {
+        // stale event of a connection closed earlier in the batch
+        if (fd == -1)
+            return;
+
+        ++busy;
+        armEvents = 0;
+        processEvent(events);
+
+        if (fd != -1 && timeouts)
+            rearmTimer();
+
+        // we may be closed deep inside the event, destroy on the way out
+        if (--busy == 0 && fd == -1 && !d_writePending && onClose) {
+            onClose();
+            return;
+        }
+
+        // must stay the last thing we do
+        if (armEvents && fd != -1)
+            arm(armEvents);
+    }
+
+    // runs on our reactor thread, a closed connection was only
+    // kept for this
+    void deliverWriteStatus(int status)
+    {
+        ++busy;
+
+        if (fd != -1)
+            onWriteApplied(status);
+        else
+            d_writePending = false;
+
+        // admission charged the write until now
+        ticket.release();
+
+        if (fd != -1 && timeouts)
+            rearmTimer();
+
+        if (--busy == 0 && fd == -1 && !d_writePending && onClose)
+            onClose();
+    }
+
+    // writer thread
+    virtual void completeWrite(int status) override;
+
+    virtual WriteCompletion* writeCompletion() override
+    {
+        return mailbox ? this : nullptr;
+    }
+
+    void rearmTimer()
+    {
+        uint64_t ticks = requestInProgress() ? timeouts->request : timeouts->idle;
+
+        if (ticks)
+            timeouts->wheel.schedule(this, ticks);
+        else
+            TimerNode::unlink();
+    }
+
+    void onTimeout()
+    {
+        close();
+    }
+
+    void processEvent(uint32_t events)
     {  
         if (events&(EPOLLHUP|EPOLLERR) && !(events&EPOLLIN)) {
             fprintf(stderr, "[%d] EPOLLHUP\n", fd);
@@ -265,8 +401,11 @@ struct EpollConnection: public EpollHandler, public ConnectionBase
             return;
         }
 
-        if (events & EPOLLOUT) {
-            startWrite();
+        // write completion goes on reading by itself
+        if (writeIoCount > 0) {
+            if (events & EPOLLOUT)
+                startWrite();
+            return;
         }
 
         if (events & EPOLLIN) {
@@ -275,53 +414,120 @@ struct EpollConnection: public EpollHandler, public ConnectionBase
 
     }
 
-    void addWriteBuf(const void* data, size_t size)
-    {
-        if (size == 0)
-            return;
-
-        size_t idx = writeIndex + writeIoCount;
-        assert(idx < writeBufs.size());
-        writeBufs[idx].iov_base = (void*)data;
-        writeBufs[idx].iov_len = size;
-        ++writeIoCount;
-    }
-    
-    void write(const void* data, size_t size)
+    virtual void flushResponses() override
     {
-        addWriteBuf(data, size);
         startWrite();
     }
-    
-    virtual void writeResponse(int result) override
+};
+
+// Statuses of pipelined POSTs. The writer thread posts them, the reactor
+// owning the connections hands them over when the eventfd fires.
+struct CompletionMailbox: public EpollHandler
+{
+    struct Item
     {
-        // fprintf(stderr, "writeResponse: %d\n", result);
-        d_response.code = static_cast<HttpStatus>(result);
-        formatHeaders(d_response);
+        EpollConnection* conn;
+        int status;
+        Item* next;
+    };
 
-        addWriteBuf(d_headersRef.data(), d_headersRef.size());
-        addWriteBuf(d_response.data(), d_response.size());
+    MpscQueue<Item> queue;
 
-        startWrite();
+    CompletionMailbox()
+        : EpollHandler(eventfd(0, EFD_NONBLOCK)) {}
+
+    int add(int efd)
+    {
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = this;
+
+        if (fd == -1 || epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fprintf(stderr, "Failed to watch write completions: %d\n", errno);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    void post(EpollConnection* conn, int status)
+    {
+        // the reactor drains everything on a wakeup, so only
+        // the first item needs one
+        if (queue.push(new Item{conn, status, nullptr})) {
+            uint64_t one = 1;
+            if (::write(fd, &one, sizeof(one)) < 0)
+                fprintf(stderr, "eventfd write error: %d\n", errno);
+        }
+    }
+
+    virtual void handleEvent(int efd, uint32_t events) override
+    {
+        uint64_t count;
+        if (::read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "eventfd read error: %d\n", errno);
+
+        Item* item = queue.popAll();
+        while (item) {
+            Item* next = item->next;
+            item->conn->deliverWriteStatus(item->status);
+            delete item;
+            item = next;
+        }
     }
 };
 
+void EpollConnection::completeWrite(int status)
+{
+    mailbox->post(this, status);
+}
+
+typedef SlabPool<EpollConnection> ConnectionPool;
+
 struct EpollListener: public EpollHandler
 {
-    boost::object_pool<EpollConnection> d_pool;
+    std::unique_ptr<ConnectionTimeouts> timeouts;
     Handler& d_handler;
     uint64_t d_count = 0;
     bool watching = false;
     bool edgeTriggered = true;
+    bool oneShot;
+    int busyPoll = 0;
+    size_t maxRequests = 0;
+    CompletionMailbox* mailbox = nullptr;
+    // reactor mode: closed during this batch, freed once it is through
+    std::vector<EpollConnection*> closed;
 
-    EpollListener(int fd, Handler& handler) 
-        : EpollHandler(fd), d_handler(handler) {}
+    EpollListener(int fd, Handler& handler, bool oneshot = true) 
+        : EpollHandler(fd), d_handler(handler), oneShot(oneshot) {}
+
+    void expireTimers()
+    {
+        if (!timeouts)
+            return;
+
+        timeouts->wheel.advance([](TimerNode* n) {
+            static_cast<EpollConnection*>(n)->onTimeout();
+        });
+    }
+
+    void freeClosed()
+    {
+        for (auto conn: closed)
+            ConnectionPool::destroy(conn);
+        closed.clear();
+    }
 
     int add(int efd)
     {
+        if (!oneShot && watching)
+            return 0;
+
         int r = 0;
         epoll_event ev;
-        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.events = EPOLLIN;
+        if (oneShot)
+            ev.events |= EPOLLONESHOT;
         if (edgeTriggered)
             ev.events |= EPOLLET;
         ev.data.ptr = this;
@@ -366,14 +572,32 @@ struct EpollListener: public EpollHandler
                 break;
             }
 
-            auto conn = d_pool.construct(infd, efd, std::ref(d_handler));
-
-            conn->onClose = [this, conn]() {
-                d_pool.destroy(conn);
-                // fprintf(stderr, "Closing connection (total: %zu)\n", connections.size());
-            };
+#ifdef SO_BUSY_POLL
+            if (busyPoll > 0 && setsockopt(infd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) < 0) {
+                fprintf(stderr, "SO_BUSY_POLL failed: %d\n", errno);
+                busyPoll = 0;
+            }
+#endif
+
+            // allocated from this thread's slab, freed by whichever thread closes it
+            auto conn = ConnectionPool::construct(infd, efd, std::ref(d_handler), oneShot);
+            conn->d_maxRequests = maxRequests;
+            conn->timeouts = timeouts.get();
+            conn->mailbox = mailbox;
+
+            // a reactor connection may still have an event later in the
+            // batch, e.g. after a write status closed it; one-shot ones
+            // are not armed once closed
+            if (oneShot) {
+                conn->onClose = [conn]() {
+                    ConnectionPool::destroy(conn);
+                    // fprintf(stderr, "Closing connection (total: %zu)\n", connections.size());
+                };
+            } else {
+                conn->onClose = [this, conn]() { closed.push_back(conn); };
+            }
 
-            conn->startRead();
+            conn->handleEvent(efd, EPOLLIN);
             ++d_count;
         }
 
@@ -381,8 +605,8 @@ struct EpollListener: public EpollHandler
     }
 };
 
-ServerEpoll::ServerEpoll(short port, Handler& handler)
-    : d_handler(handler), d_port(port)
+ServerEpoll::ServerEpoll(short port, Handler& handler, const ServerOptions& options)
+    : d_handler(handler), d_port(port), d_options(options)
 {
 }
 
@@ -391,6 +615,23 @@ ServerEpoll::~ServerEpoll()
 }
 
 void ServerEpoll::run(int threadsCount)
+{
+    if (!d_options.reactorPerThread) {
+        runShared(threadsCount);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < threadsCount; ++i) {
+        threads.emplace_back([this, i]() { runReactor(i); });
+    }
+
+    for (auto& t: threads)
+        t.join();
+}
+
+void ServerEpoll::runShared(int threadsCount)
 {
     int listenSock = create_and_bind(d_port);
     make_socket_non_blocking(listenSock);
@@ -398,13 +639,20 @@ void ServerEpoll::run(int threadsCount)
 
     int efd = epoll_create1(0);
     EpollListener listener(listenSock, d_handler);
+    listener.busyPoll = d_options.busyPoll;
+    listener.maxRequests = std::max(d_options.maxRequests, 0);
     listener.startListen(efd);
+
+    // connections hop between threads here, a single threaded wheel won't do
+    if (d_options.idleTimeout > 0 || d_options.requestTimeout > 0)
+        fprintf(stderr, "Idle and request timeouts need reactor mode, ignored\n");
             
     std::vector<std::thread> threads;
 
     for (int i = 0; i < threadsCount; ++i) {
         threads.emplace_back([this, i, &listener, efd]() {
-               // set_thread_affinity(i); 
+               if (d_options.pinThreads)
+                   set_thread_affinity(i % std::max(std::thread::hardware_concurrency(), 1u));
                dispatch(efd, listener); });
     } 
 
@@ -412,20 +660,86 @@ void ServerEpoll::run(int threadsCount)
         t.join();
 }
 
+void ServerEpoll::runReactor(int index)
+{
+    if (d_options.pinThreads)
+        set_thread_affinity(index % std::max(std::thread::hardware_concurrency(), 1u));
+
+    // SO_REUSEPORT lets the kernel spread incoming connections
+    // between the per-thread listening sockets
+    int listenSock = create_and_bind(d_port);
+    if (listenSock < 0)
+        return;
+
+    make_socket_non_blocking(listenSock);
+    fprintf(stdout, "Listen socket [%d]: %d\n", index, listenSock);
+
+    int efd = epoll_create1(0);
+    EpollListener listener(listenSock, d_handler, false);
+    listener.busyPoll = d_options.busyPoll;
+    listener.maxRequests = std::max(d_options.maxRequests, 0);
+
+    if (d_options.idleTimeout > 0 || d_options.requestTimeout > 0) {
+        const uint64_t ticksPerSec = 1000 / TimerWheel::TICK_MS;
+        listener.timeouts.reset(new ConnectionTimeouts());
+        listener.timeouts->idle = std::max(d_options.idleTimeout, 0) * ticksPerSec;
+        listener.timeouts->request = std::max(d_options.requestTimeout, 0) * ticksPerSec;
+    }
+
+    // pipelined POSTs report back to the reactor of their connection
+    CompletionMailbox mailbox;
+    if (d_options.asyncWrites) {
+        if (mailbox.add(efd) < 0) {
+            ::close(efd);
+            return;
+        }
+        listener.mailbox = &mailbox;
+    }
+
+    if (listener.startListen(efd) < 0) {
+        ::close(efd);
+        return;
+    }
+
+    dispatch(efd, listener);
+    ::close(efd);
+}
+
 void ServerEpoll::dispatch(int efd, EpollListener& l)
 {
-    const size_t MAXEVENTS = 1;
-    epoll_event events[MAXEVENTS];
+    const int maxEvents = std::max(d_options.maxEvents, 1);
+    std::vector<epoll_event> events(maxEvents);
+
+    // Spin with zero-timeout waits after every wakeup. A spin phase that 
+    // ends without events halves the budget, a hit while spinning doubles 
+    // it back, so a server with sparse traffic quickly stops burning cpu.
+    const int spinMax = std::max(d_options.spinCount, 0);
+    int spinBudget = spinMax;
+    int spinLeft = spinBudget;
+
+    // wake up every tick while there are timers to run
+    const int waitMs = l.timeouts ? TimerWheel::TICK_MS : 1000;
 
     while(true) {
-        int n = epoll_wait(efd, events, MAXEVENTS, 1000);
+        int timeout = spinLeft > 0 ? 0 : waitMs;
+        int n = epoll_wait(efd, events.data(), maxEvents, timeout);
         if (n == -1 && errno != EINTR) {
             fprintf(stderr, "epoll_wait error: %d\n", errno);
             return;
         }
 
         if (n == 0) {
+            if (spinLeft > 0) {
+                if (--spinLeft == 0)
+                    spinBudget /= 2;
+                continue;
+            }
+
             l.onIdle(efd);
+        } else if (n > 0 && spinMax > 0) {
+            if (timeout == 0)
+                spinBudget = std::min(std::max(spinBudget * 2, 1), spinMax);
+            spinLeft = std::max(spinBudget, 1);
         }
 
         for (int i = 0; i < n; ++i) {
@@ -435,6 +749,9 @@ void ServerEpoll::dispatch(int efd, EpollListener& l)
                static_cast<EpollHandler*>(ev.data.ptr)->handleEvent(efd, ef);
            }
         }
+
+        l.expireTimers();
+        l.freeClosed();
     }
 }
 
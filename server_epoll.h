@@ -1,18 +1,61 @@
+#pragma once
+
 #include <sys/epoll.h>
 #include <vector>
 
 class Handler;
 class EpollListener;
 
+int make_socket_non_blocking(int sfd);
+int create_and_bind(short port);
+int set_thread_affinity(int cpu);
+
+struct ServerOptions
+{
+    // every worker owns its epoll fd and SO_REUSEPORT listener,
+    // connections never leave the accepting thread
+    bool reactorPerThread = false;
+
+    // pin worker i to cpu i
+    bool pinThreads = false;
+
+    // events drained by a single epoll_wait
+    int maxEvents = 1;
+
+    // SO_BUSY_POLL for accepted sockets, microseconds
+    int busyPoll = 0;
+
+    // zero-timeout epoll_wait calls before a blocking wait
+    int spinCount = 0;
+
+    // seconds a keep-alive connection may stay silent,
+    // per-thread timer wheels need reactor mode
+    int idleTimeout = 0;
+
+    // seconds to receive a whole request and write its response
+    int requestTimeout = 0;
+
+    // connection is closed after this many requests
+    int maxRequests = 0;
+
+    // POSTs complete asynchronously through the handler's write pipeline,
+    // reactor mode only
+    bool asyncWrites = false;
+};
+
 class ServerEpoll
 {
     Handler& d_handler;
     short d_port;
+    ServerOptions d_options;
+
     void dispatch(int efd, EpollListener& l);
+    void runShared(int threadsCount);
+    void runReactor(int index);
 
 public:
 
-    ServerEpoll(short port, Handler& handler);
+    ServerEpoll(short port, Handler& handler, const ServerOptions& options = ServerOptions());
     ~ServerEpoll();
 
     void run(int threadsCount);
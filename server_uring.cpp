@@ -0,0 +1,380 @@
+
+#include "server_uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <vector>
+
+#include <liburing.h>
+#include <boost/pool/object_pool.hpp>
+
+#include "connection.h"
+
+namespace {
+
+const unsigned RING_ENTRIES = 1024;
+const unsigned BUF_COUNT = 512; // must be a power of 2
+const unsigned BUF_SIZE = 8192;
+const int BUF_GROUP = 0;
+// completions taken off the ring at once
+const unsigned CQE_BATCH = 64;
+
+// operation type lives in the low bits of the connection pointer
+enum OpType : uint64_t {
+    OP_ACCEPT = 0,
+    OP_RECV = 1,
+    OP_SEND = 2
+};
+
+const uint64_t OP_MASK = 0x3;
+
+} // namespace
+
+class UringReactor;
+
+struct UringConnection: public ConnectionBase
+{
+    int fd;
+    UringReactor& reactor;
+    int inflight = 0;
+    bool recvPending = false;
+    bool sendPending = false;
+    msghdr msg;
+
+    UringConnection(int openfd, UringReactor& r, Handler& handler) :
+        ConnectionBase(handler),
+        fd(openfd),
+        reactor(r)
+    {
+        int i = 1;
+        setsockopt(fd, SOL_SOCKET,SO_KEEPALIVE, &i, sizeof(i));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+    }
+
+    virtual void startRead() override;
+    virtual void flushResponses() override;
+    virtual void close() override;
+
+    void onRecv(int res, unsigned flags);
+    void onSend(int res);
+};
+
+class UringReactor
+{
+public:
+
+    UringReactor(Handler& handler, int listenFd)
+        : d_handler(handler), d_listenFd(listenFd), d_buffers(BUF_COUNT * BUF_SIZE)
+    {
+    }
+
+    ~UringReactor()
+    {
+        if (d_bufRing)
+            io_uring_free_buf_ring(&d_ring, d_bufRing, BUF_COUNT, BUF_GROUP);
+        if (d_initialized)
+            io_uring_queue_exit(&d_ring);
+    }
+
+    bool init()
+    {
+        int r = io_uring_queue_init(RING_ENTRIES, &d_ring, 0);
+        if (r < 0) {
+            fprintf(stderr, "io_uring_queue_init failed: %d\n", -r);
+            return false;
+        }
+
+        d_initialized = true;
+
+        d_bufRing = io_uring_setup_buf_ring(&d_ring, BUF_COUNT, BUF_GROUP, 0, &r);
+        if (!d_bufRing) {
+            fprintf(stderr, "io_uring_setup_buf_ring failed: %d\n", -r);
+            return false;
+        }
+
+        for (unsigned i = 0; i < BUF_COUNT; ++i) {
+            io_uring_buf_ring_add(d_bufRing, buffer(i), BUF_SIZE, i,
+                    io_uring_buf_ring_mask(BUF_COUNT), i);
+        }
+
+        io_uring_buf_ring_advance(d_bufRing, BUF_COUNT);
+        return true;
+    }
+
+    char* buffer(unsigned bid)
+    {
+        return d_buffers.data() + size_t(bid) * BUF_SIZE;
+    }
+
+    void recycleBuffer(unsigned bid)
+    {
+        io_uring_buf_ring_add(d_bufRing, buffer(bid), BUF_SIZE, bid,
+                io_uring_buf_ring_mask(BUF_COUNT), 0);
+        io_uring_buf_ring_advance(d_bufRing, 1);
+    }
+
+    io_uring_sqe* getSqe(unsigned needed = 1)
+    {
+        // linked requests must go to the kernel in the same submission
+        if (io_uring_sq_space_left(&d_ring) < needed)
+            io_uring_submit(&d_ring);
+
+        return io_uring_get_sqe(&d_ring);
+    }
+
+    void queueAccept()
+    {
+        auto sqe = getSqe();
+        io_uring_prep_multishot_accept(sqe, d_listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+        io_uring_sqe_set_data64(sqe, OP_ACCEPT);
+    }
+
+    void queueRecv(UringConnection* conn)
+    {
+        auto sqe = getSqe();
+        io_uring_prep_recv(sqe, conn->fd, nullptr, BUF_SIZE, 0);
+        io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+        sqe->buf_group = BUF_GROUP;
+        io_uring_sqe_set_data64(sqe, reinterpret_cast<uint64_t>(conn) | OP_RECV);
+
+        ++conn->inflight;
+        conn->recvPending = true;
+    }
+
+    // the follow-up recv is linked to the send, so the kernel
+    // starts it right after the response is out
+    void queueSend(UringConnection* conn, bool linkRecv)
+    {
+        linkRecv = linkRecv && !conn->recvPending;
+
+        memset(&conn->msg, 0, sizeof(conn->msg));
+        conn->msg.msg_iov = &conn->writeBufs[conn->writeIndex];
+        conn->msg.msg_iovlen = conn->writeIoCount;
+
+        auto sqe = getSqe(linkRecv ? 2 : 1);
+        io_uring_prep_sendmsg(sqe, conn->fd, &conn->msg, MSG_WAITALL | MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, reinterpret_cast<uint64_t>(conn) | OP_SEND);
+
+        ++conn->inflight;
+        conn->sendPending = true;
+
+        if (linkRecv) {
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            queueRecv(conn);
+        }
+    }
+
+    void onAccept(int res, unsigned flags)
+    {
+        if (!(flags & IORING_CQE_F_MORE))
+            queueAccept();
+
+        if (res < 0) {
+            fprintf(stderr, "accept failed: %d\n", -res);
+            return;
+        }
+
+        auto conn = d_pool.construct(res, std::ref(*this), std::ref(d_handler));
+        conn->d_maxRequests = maxRequests;
+        conn->startRead();
+        ++d_count;
+    }
+
+    size_t maxRequests = 0;
+
+    void handleCompletion(io_uring_cqe* cqe)
+    {
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        auto op = data & OP_MASK;
+
+        if (op == OP_ACCEPT) {
+            onAccept(cqe->res, cqe->flags);
+            return;
+        }
+
+        auto conn = reinterpret_cast<UringConnection*>(data & ~OP_MASK);
+        --conn->inflight;
+
+        if (conn->fd != -1) {
+            if (op == OP_RECV)
+                conn->onRecv(cqe->res, cqe->flags);
+            else
+                conn->onSend(cqe->res);
+        } else if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            recycleBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+
+        // closed connections live until the kernel is done with them
+        if (conn->fd == -1 && conn->inflight == 0)
+            d_pool.destroy(conn);
+    }
+
+    void run()
+    {
+        queueAccept();
+
+        while (true) {
+            int r = io_uring_submit_and_wait(&d_ring, 1);
+            if (r < 0 && r != -EINTR) {
+                fprintf(stderr, "io_uring_submit_and_wait error: %d\n", -r);
+                return;
+            }
+
+            // whatever is left over makes the next wait return at once
+            io_uring_cqe* cqes[CQE_BATCH];
+            unsigned count = io_uring_peek_batch_cqe(&d_ring, cqes, CQE_BATCH);
+
+            for (unsigned i = 0; i < count; ++i)
+                handleCompletion(cqes[i]);
+
+            io_uring_cq_advance(&d_ring, count);
+        }
+    }
+
+private:
+
+    Handler& d_handler;
+    int d_listenFd;
+    bool d_initialized = false;
+    io_uring d_ring;
+    io_uring_buf_ring* d_bufRing = nullptr;
+    std::vector<char> d_buffers;
+    boost::object_pool<UringConnection> d_pool;
+    uint64_t d_count = 0;
+};
+
+void UringConnection::startRead()
+{
+    if (!recvPending)
+        reactor.queueRecv(this);
+}
+
+void UringConnection::flushResponses()
+{
+    reactor.queueSend(this, !d_closeAfterWrite);
+}
+
+void UringConnection::close()
+{
+    if (fd == -1)
+        return;
+
+    // completes the pending recv, the reactor frees us afterwards
+    ::shutdown(fd, SHUT_RDWR);
+    ::close(fd);
+    fd = -1;
+}
+
+void UringConnection::onRecv(int res, unsigned flags)
+{
+    recvPending = false;
+
+    // a failed or empty recv may still have taken a buffer
+    if (res <= 0 && (flags & IORING_CQE_F_BUFFER))
+        reactor.recycleBuffer(flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (res == -ENOBUFS || (res == -ECANCELED && !sendPending)) {
+        // buffer ring ran dry or a short send broke the link
+        startRead();
+        return;
+    }
+
+    if (res == -ECANCELED)
+        return;
+
+    if (res <= 0) {
+        if (res < 0 && res != -ECONNRESET)
+            fprintf(stderr, "recv error: %d\n", -res);
+        close();
+        return;
+    }
+
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    uv_buf_t buf{reactor.buffer(bid), BUF_SIZE};
+    onRead(res, &buf);
+    reactor.recycleBuffer(bid);
+
+    // request is incomplete, keep reading
+    if (fd != -1 && !sendPending)
+        startRead();
+}
+
+void UringConnection::onSend(int res)
+{
+    sendPending = false;
+
+    if (res < 0) {
+        if (res != -EPIPE && res != -ECONNRESET)
+            fprintf(stderr, "send error: %d\n", -res);
+        close();
+        return;
+    }
+
+    // update buffer pointers
+    consumeWritten(res);
+
+    if (writeIoCount > 0) {
+        reactor.queueSend(this, false);
+        return;
+    }
+
+    onWriteComplete();
+}
+
+ServerUring::ServerUring(short port, Handler& handler, const ServerOptions& options)
+    : d_handler(handler), d_port(port), d_options(options)
+{
+}
+
+ServerUring::~ServerUring()
+{
+}
+
+void ServerUring::run(int threadsCount)
+{
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < threadsCount; ++i) {
+        threads.emplace_back([this, i]() { runReactor(i); });
+    }
+
+    for (auto& t: threads)
+        t.join();
+}
+
+void ServerUring::runReactor(int index)
+{
+    if (d_options.pinThreads)
+        set_thread_affinity(index % std::max(std::thread::hardware_concurrency(), 1u));
+
+    int listenSock = create_and_bind(d_port);
+    if (listenSock < 0)
+        return;
+
+    if (::listen(listenSock, 2048) < 0) {
+        fprintf(stderr, "listen() failed: %d\n", errno);
+        ::close(listenSock);
+        return;
+    }
+
+    fprintf(stdout, "Listen socket [%d]: %d\n", index, listenSock);
+
+    {
+        UringReactor reactor(d_handler, listenSock);
+        reactor.maxRequests = std::max(d_options.maxRequests, 0);
+        if (reactor.init())
+            reactor.run();
+    }
+
+    ::close(listenSock);
+}
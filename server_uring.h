@@ -0,0 +1,23 @@
+#pragma once
+
+#include "server_epoll.h"
+
+class Handler;
+
+// accept, recv and send go through io_uring,
+// one ring and one SO_REUSEPORT listener per thread
+class ServerUring
+{
+    Handler& d_handler;
+    short d_port;
+    ServerOptions d_options;
+
+    void runReactor(int index);
+
+public:
+
+    ServerUring(short port, Handler& handler, const ServerOptions& options = ServerOptions());
+    ~ServerUring();
+
+    void run(int threadsCount);
+};
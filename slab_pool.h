@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Per-thread slab allocator for objects of one type.
+// Every thread allocates from its own pool without locking. An object
+// freed by another thread is pushed onto the owner's lock-free remote
+// list, which the owner takes over in one exchange once its local free
+// list runs dry. The owner only ever detaches the whole list, so the
+// push side needs no ABA protection.
+template <typename T, size_t SlabSize = 256>
+class SlabPool
+{
+public:
+
+    template <typename... Args>
+    static T* construct(Args&&... args)
+    {
+        Slot* s = local().allocate();
+        return new (&s->storage) T(std::forward<Args>(args)...);
+    }
+
+    // may be called from any thread
+    static void destroy(T* p)
+    {
+        p->~T();
+
+        Slot* s = reinterpret_cast<Slot*>(p);
+        Pool* owner = s->owner;
+        if (owner == &local())
+            owner->freeLocal(s);
+        else
+            owner->freeRemote(s);
+    }
+
+private:
+
+    struct Pool;
+
+    struct Slot
+    {
+        // must stay first, T* and Slot* are the same address
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        Slot* next;
+        Pool* owner;
+    };
+
+    struct Pool
+    {
+        Slot* freeList = nullptr;
+        std::atomic<Slot*> remoteFree{nullptr};
+        std::vector<std::unique_ptr<Slot[]>> slabs;
+        size_t live = 0;
+
+        Slot* allocate()
+        {
+            if (!freeList)
+                collectRemote();
+            if (!freeList)
+                grow();
+
+            Slot* s = freeList;
+            freeList = s->next;
+            ++live;
+            return s;
+        }
+
+        void freeLocal(Slot* s)
+        {
+            s->next = freeList;
+            freeList = s;
+            --live;
+        }
+
+        void freeRemote(Slot* s)
+        {
+            Slot* head = remoteFree.load(std::memory_order_relaxed);
+            do {
+                s->next = head;
+            } while (!remoteFree.compare_exchange_weak(head, s,
+                        std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        void collectRemote()
+        {
+            Slot* s = remoteFree.exchange(nullptr, std::memory_order_acquire);
+            while (s) {
+                Slot* next = s->next;
+                freeLocal(s);
+                s = next;
+            }
+        }
+
+        void grow()
+        {
+            std::unique_ptr<Slot[]> slab(new Slot[SlabSize]);
+            for (size_t i = 0; i < SlabSize; ++i) {
+                slab[i].owner = this;
+                slab[i].next = freeList;
+                freeList = &slab[i];
+            }
+
+            slabs.push_back(std::move(slab));
+        }
+    };
+
+    // Objects may outlive the thread that allocated them. Their pool is
+    // then left behind so remote frees still have somewhere to go.
+    struct Holder
+    {
+        Pool* pool = new Pool();
+
+        ~Holder()
+        {
+            pool->collectRemote();
+            if (pool->live == 0)
+                delete pool;
+        }
+    };
+
+    static Pool& local()
+    {
+        static thread_local Holder holder;
+        return *holder.pool;
+    }
+};
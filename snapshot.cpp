@@ -0,0 +1,429 @@
+#include "database.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace snapshot;
+
+namespace {
+
+uint64_t align(uint64_t offset)
+{
+    return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+template <typename T>
+Section allocate(uint64_t& end, size_t count)
+{
+    Section s{align(end), count};
+    end = s.offset + count * sizeof(T);
+    return s;
+}
+
+class StringsWriter
+{
+public:
+
+    bool add(boost::string_ref s, String& dest)
+    {
+        if (d_bytes.size() + s.size() > UINT32_MAX)
+            return false;
+
+        dest.offset = d_bytes.size();
+        dest.length = s.size();
+        d_bytes.append(s.data(), s.size());
+        return true;
+    }
+
+    bool add(const StringDictionary& dict, std::vector<String>& dest)
+    {
+        dest.resize(dict.size());
+        for (size_t i = 0; i < dest.size(); ++i) {
+            if (!add(dict.get(i + 1), dest[i]))
+                return false;
+        }
+        return true;
+    }
+
+    const std::string& bytes() const
+    {
+        return d_bytes;
+    }
+
+private:
+
+    std::string d_bytes;
+};
+
+// writes sections at the offsets the header gives them
+class SectionWriter
+{
+public:
+
+    explicit SectionWriter(FILE* file)
+        : d_file(file) {}
+
+    template <typename T>
+    void write(const Section& s, const T* items)
+    {
+        static const char zeros[ALIGNMENT] = {};
+        fwrite(zeros, 1, s.offset - d_pos, d_file);
+        fwrite(items, sizeof(T), s.count, d_file);
+        d_pos = s.offset + s.count * sizeof(T);
+    }
+
+private:
+
+    FILE* d_file;
+    uint64_t d_pos = sizeof(Header);
+};
+
+// Read-only view of a mapped snapshot, offsets become pointers here
+class SnapshotView
+{
+public:
+
+    SnapshotView(const char* base, size_t size)
+        : d_base(base), d_size(size), d_header(reinterpret_cast<const Header*>(base)) {}
+
+    const Header& header() const
+    {
+        return *d_header;
+    }
+
+    template <typename T>
+    const T* items(const Section& s) const
+    {
+        return reinterpret_cast<const T*>(d_base + s.offset);
+    }
+
+    boost::string_ref string(const String& s) const
+    {
+        return boost::string_ref(d_base + d_header->strings.offset + s.offset, s.length);
+    }
+
+    bool valid() const;
+
+private:
+
+    template <typename T>
+    bool valid(const Section& s) const
+    {
+        return s.offset % ALIGNMENT == 0 && s.offset >= sizeof(Header)
+            && s.offset <= d_size && s.count <= (d_size - s.offset) / sizeof(T);
+    }
+
+    bool valid(const String& s) const
+    {
+        return uint64_t(s.offset) + s.length <= d_header->strings.count;
+    }
+
+    bool validNames(const Section& s) const
+    {
+        auto names = items<String>(s);
+        for (size_t i = 0; i < s.count; ++i) {
+            if (!valid(names[i]))
+                return false;
+        }
+        return true;
+    }
+
+    const char* d_base;
+    size_t d_size;
+    const Header* d_header;
+};
+
+bool SnapshotView::valid() const
+{
+    const Header& h = *d_header;
+
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION || h.size != d_size)
+        return false;
+
+    if (!valid<UserRecord>(h.users) || !valid<LocationRecord>(h.locations) || !valid<VisitRecord>(h.visits)
+            || !valid<String>(h.places) || !valid<String>(h.countries) || !valid<String>(h.cities)
+            || !valid<char>(h.strings))
+        return false;
+
+    if (!validNames(h.places) || !validNames(h.countries) || !validNames(h.cities))
+        return false;
+
+    auto users = items<UserRecord>(h.users);
+    for (size_t i = 0; i < h.users.count; ++i) {
+        if (!valid(users[i].email) || !valid(users[i].first_name) || !valid(users[i].last_name))
+            return false;
+    }
+
+    auto locations = items<LocationRecord>(h.locations);
+    for (size_t i = 0; i < h.locations.count; ++i) {
+        const auto& l = locations[i];
+        if (l.place > h.places.count || l.country > h.countries.count || l.city > h.cities.count)
+            return false;
+    }
+
+    // a visit of a missing user or location would make a placeholder
+    std::vector<uint32_t> userIds, locationIds;
+    userIds.reserve(h.users.count);
+    locationIds.reserve(h.locations.count);
+
+    for (size_t i = 0; i < h.users.count; ++i)
+        userIds.push_back(users[i].id);
+    for (size_t i = 0; i < h.locations.count; ++i)
+        locationIds.push_back(locations[i].id);
+
+    std::sort(userIds.begin(), userIds.end());
+    std::sort(locationIds.begin(), locationIds.end());
+
+    auto visits = items<VisitRecord>(h.visits);
+    for (size_t i = 0; i < h.visits.count; ++i) {
+        if (!std::binary_search(userIds.begin(), userIds.end(), visits[i].user)
+                || !std::binary_search(locationIds.begin(), locationIds.end(), visits[i].location))
+            return false;
+    }
+
+    return true;
+}
+
+// ids the names get in this process, by snapshot id
+std::vector<uint32_t> internNames(const SnapshotView& view, const Section& s, StringDictionary& dict)
+{
+    std::vector<uint32_t> ids(s.count + 1, 0);
+    auto names = view.items<String>(s);
+    for (size_t i = 0; i < s.count; ++i)
+        ids[i + 1] = dict.intern(view.string(names[i]));
+    return ids;
+}
+
+// f(from, to) over consecutive ranges of [0, count), one per core
+template <typename F>
+void forEachRange(size_t count, F f)
+{
+    size_t threadsCount = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < threadsCount; ++i)
+        threads.emplace_back([=] { f(count * i / threadsCount, count * (i + 1) / threadsCount); });
+
+    for (auto& t: threads)
+        t.join();
+}
+
+} // namespace
+
+bool Database::saveSnapshot(const std::string& path, uint64_t source)
+{
+    std::vector<UserRecord> users;
+    std::vector<LocationRecord> locations;
+    std::vector<VisitRecord> visits;
+    StringsWriter strings;
+    bool fits = true;
+
+    {
+        EpochGuard guard;
+
+        // placeholders made for visits that came before their user or
+        // location have id 0
+        d_users.forEachSlice(0, 1, [&](UserVisits& uv) {
+            auto version = uv.current.get();
+            if (!version || !version->entity.id)
+                return;
+
+            const User& u = version->entity;
+            UserRecord r = {};
+            r.id = u.id;
+            r.birth_date = u.birth_date;
+            r.gender = u.gender;
+            fits = fits && strings.add(u.email, r.email) && strings.add(u.first_name, r.first_name)
+                && strings.add(u.last_name, r.last_name);
+            users.push_back(r);
+        });
+
+        d_locations.forEachSlice(0, 1, [&](LocationVisits& lv) {
+            auto version = lv.current.get();
+            if (!version || !version->entity.id)
+                return;
+
+            const Location& l = version->entity;
+            locations.push_back(LocationRecord{l.id, l.place, l.country, l.city, l.distance});
+        });
+
+        d_visits.forEachSlice(0, 1, [&](VisitWrap& w) {
+            auto version = w.current.get();
+            if (!version)
+                return;
+
+            const Visit& v = version->entity;
+            VisitRecord r = {};
+            r.id = v.id;
+            r.location = v.location;
+            r.user = v.user;
+            r.visited_at = v.visited_at;
+            r.mark = v.mark;
+            visits.push_back(r);
+        });
+    }
+
+    // interned after the locations were read, so every id they use is there
+    std::vector<String> places, countries, cities;
+    fits = fits && strings.add(placeNames(), places) && strings.add(countryNames(), countries)
+        && strings.add(cityNames(), cities);
+
+    if (!fits) {
+        fprintf(stderr, "%s: strings do not fit a snapshot\n", path.c_str());
+        return false;
+    }
+
+    Header h = {};
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.now = d_now;
+    h.source = source;
+
+    uint64_t end = sizeof(Header);
+    h.users = allocate<UserRecord>(end, users.size());
+    h.locations = allocate<LocationRecord>(end, locations.size());
+    h.visits = allocate<VisitRecord>(end, visits.size());
+    h.places = allocate<String>(end, places.size());
+    h.countries = allocate<String>(end, countries.size());
+    h.cities = allocate<String>(end, cities.size());
+    h.strings = allocate<char>(end, strings.bytes().size());
+    h.size = end;
+
+    // processes starting meanwhile never map a partial file
+    std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        perror(tmp.c_str());
+        return false;
+    }
+
+    fwrite(&h, sizeof(h), 1, file);
+
+    SectionWriter writer(file);
+    writer.write(h.users, users.data());
+    writer.write(h.locations, locations.data());
+    writer.write(h.visits, visits.data());
+    writer.write(h.places, places.data());
+    writer.write(h.countries, countries.data());
+    writer.write(h.cities, cities.data());
+    writer.write(h.strings, strings.bytes().data());
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    std::cout << "Snapshot saved to " << path << ": " << h.size / (1024 * 1024) << " MB" << std::endl;
+    return true;
+}
+
+bool Database::loadSnapshot(const std::string& path, uint64_t source)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+        fprintf(stderr, "%s: not a snapshot\n", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    SnapshotView view(static_cast<const char*>(data), size);
+
+    // nothing is created from a snapshot that does not check out
+    if (!view.valid()) {
+        fprintf(stderr, "%s: broken snapshot or another version\n", path.c_str());
+        munmap(data, size);
+        return false;
+    }
+
+    const Header& h = view.header();
+
+    if (h.source != source) {
+        fprintf(stderr, "%s: made from other data, ignored\n", path.c_str());
+        munmap(data, size);
+        return false;
+    }
+
+    setNow(h.now);
+
+    auto places = internNames(view, h.places, placeNames());
+    auto countries = internNames(view, h.countries, countryNames());
+    auto cities = internNames(view, h.cities, cityNames());
+
+    auto users = view.items<UserRecord>(h.users);
+    auto locations = view.items<LocationRecord>(h.locations);
+    auto visits = view.items<VisitRecord>(h.visits);
+
+    forEachRange(h.users.count, [&](size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            const UserRecord& r = users[i];
+            User u;
+            u.id = r.id;
+            u.birth_date = r.birth_date;
+            u.gender = r.gender;
+            u.email = view.string(r.email).to_string();
+            u.first_name = view.string(r.first_name).to_string();
+            u.last_name = view.string(r.last_name).to_string();
+            create(u);
+        }
+    });
+
+    forEachRange(h.locations.count, [&](size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            const LocationRecord& r = locations[i];
+            Location l;
+            l.id = r.id;
+            l.place = places[r.place];
+            l.country = countries[r.country];
+            l.city = cities[r.city];
+            l.distance = r.distance;
+            create(l);
+        }
+    });
+
+    beginBulkLoad();
+    forEachRange(h.visits.count, [&](size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            const VisitRecord& r = visits[i];
+            Visit v;
+            v.id = r.id;
+            v.location = r.location;
+            v.user = r.user;
+            v.visited_at = r.visited_at;
+            v.mark = r.mark;
+            create(v);
+        }
+    });
+    finishBulkLoad();
+
+    munmap(data, size);
+
+    std::cout << "Snapshot loaded from " << path << std::endl;
+    printStat();
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+
+// On-disk layout of Database snapshots, a binary fast-reload format: the
+// entities and strings the JSON loader would produce, read back without
+// tokenizing. Visit lists, avg indexes and cached responses are not in
+// it, loading rebuilds them through the bulk load path. All references
+// are offsets from the start of the file. Integers are in host byte
+// order, a snapshot is only meant for the box that wrote it.
+namespace snapshot {
+
+const char MAGIC[8] = {'H', 'L', 'C', 'S', 'N', 'A', 'P', '\0'};
+
+// bump on any change of the structures below
+const uint32_t VERSION = 2;
+
+// sections start at multiples of it
+const uint64_t ALIGNMENT = 8;
+
+struct Section
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+// bytes in the strings section
+struct String
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct UserRecord
+{
+    uint32_t id;
+    int32_t birth_date;
+    String email;
+    String first_name;
+    String last_name;
+    char gender;
+    char reserved[3];
+};
+
+// place, country and city are indexes into the name sections plus one,
+// 0 is the empty string as in StringDictionary
+struct LocationRecord
+{
+    uint32_t id;
+    uint32_t place;
+    uint32_t country;
+    uint32_t city;
+    uint32_t distance;
+};
+
+struct VisitRecord
+{
+    uint32_t id;
+    uint32_t location;
+    uint32_t user;
+    uint32_t visited_at;
+    uint8_t mark;
+    uint8_t reserved[3];
+};
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t now;
+    // of the whole file, a shorter one was cut while written
+    uint64_t size;
+    // Loader::fingerprint() of the data it was made from, a snapshot
+    // of another dataset is not loaded
+    uint64_t source;
+
+    Section users;
+    Section locations;
+    Section visits;
+
+    // String lists in dictionary id order
+    Section places;
+    Section countries;
+    Section cities;
+
+    // raw bytes, count is the size
+    Section strings;
+};
+
+} // namespace snapshot
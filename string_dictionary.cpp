@@ -0,0 +1,94 @@
+#include "string_dictionary.h"
+
+namespace {
+
+const size_t INITIAL_SLOTS = 64;
+
+} // namespace
+
+StringDictionary::StringDictionary()
+{
+    d_table.publish(new Table(INITIAL_SLOTS));
+}
+
+size_t StringDictionary::hash(boost::string_ref s)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (char c: s) {
+        h ^= uint8_t(c);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool StringDictionary::find(const Table& table, boost::string_ref s, uint32_t& id) const
+{
+    for (size_t i = hash(s) & table.mask;; i = (i + 1) & table.mask) {
+        uint32_t candidate = table.slots[i].load(std::memory_order_acquire);
+        if (!candidate)
+            return false;
+
+        if (get(candidate) == s) {
+            id = candidate;
+            return true;
+        }
+    }
+}
+
+void StringDictionary::insert(Table& table, uint32_t id, size_t h)
+{
+    size_t i = h & table.mask;
+    while (table.slots[i].load(std::memory_order_relaxed))
+        i = (i + 1) & table.mask;
+
+    table.slots[i].store(id, std::memory_order_release);
+}
+
+bool StringDictionary::find(boost::string_ref s, uint32_t& id) const
+{
+    if (s.empty()) {
+        id = 0;
+        return true;
+    }
+
+    EpochGuard guard;
+    return find(*d_table.get(), s, id);
+}
+
+uint32_t StringDictionary::intern(boost::string_ref s)
+{
+    uint32_t id;
+    if (find(s, id))
+        return id;
+
+    std::lock_guard<std::mutex> lk(d_mutex);
+
+    // slots are atomic, the writer fills them in the published table
+    Table* table = const_cast<Table*>(d_table.get());
+    if (find(*table, s, id))
+        return id;
+
+    id = d_next++;
+    d_strings[id] = s.to_string();
+    d_strings.publish(id);
+
+    size_t slots = table->mask + 1;
+    if (size_t(id) * 2 <= slots) {
+        insert(*table, id, hash(s));
+        return id;
+    }
+
+    std::unique_ptr<Table> next(new Table(slots * 2));
+    for (uint32_t i = 1; i <= id; ++i)
+        insert(*next, i, hash(get(i)));
+
+    d_table.publish(next.release());
+    return id;
+}
+
+boost::string_ref StringDictionary::get(uint32_t id) const
+{
+    const std::string* s = d_strings.find(id);
+    return s ? boost::string_ref(*s) : boost::string_ref();
+}
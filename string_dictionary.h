@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "epoch.h"
+#include "id_index.h"
+
+// Interned strings by small id, 0 stands for the empty string. Lookups
+// both ways run without locks: strings sit in an IdIndex and the ids in
+// an open addressing table whose slots are filled once, readers only
+// need an EpochGuard. New strings are added under a mutex, a full table
+// is copied into a twice larger one.
+class StringDictionary
+{
+public:
+
+    StringDictionary();
+
+    uint32_t intern(boost::string_ref s);
+
+    // false if the string was never interned
+    bool find(boost::string_ref s, uint32_t& id) const;
+
+    boost::string_ref get(uint32_t id) const;
+
+    size_t size() const
+    {
+        return d_strings.size();
+    }
+
+private:
+
+    struct Table
+    {
+        explicit Table(size_t size)
+            : mask(size - 1), slots(new std::atomic<uint32_t>[size]()) {}
+
+        size_t mask;
+        std::unique_ptr<std::atomic<uint32_t>[]> slots;
+    };
+
+    static size_t hash(boost::string_ref s);
+
+    bool find(const Table& table, boost::string_ref s, uint32_t& id) const;
+    void insert(Table& table, uint32_t id, size_t h);
+
+    IdIndex<std::string> d_strings;
+    Versioned<Table> d_table;
+
+    std::mutex d_mutex;
+    uint32_t d_next = 1;
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <time.h>
+
+// Intrusive timer, owners derive from it. Linked timers sit in a
+// circular list of their wheel slot, unlinking is O(1).
+struct TimerNode
+{
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0;
+
+    TimerNode() {}
+    TimerNode(const TimerNode&) = delete;
+    TimerNode& operator =(const TimerNode&) = delete;
+
+    ~TimerNode()
+    {
+        unlink();
+    }
+
+    bool linked() const
+    {
+        return prev != nullptr;
+    }
+
+    void unlink()
+    {
+        if (!prev)
+            return;
+
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+};
+
+// Two level hierarchical timer wheel, single threaded.
+// Level 0 has one slot per tick, level 1 one slot per level 0 turn,
+// timers past level 1 wait in its farthest slot and get rescheduled
+// when it comes around. Scheduling, cancelling and expiring are O(1).
+class TimerWheel
+{
+public:
+
+    static const unsigned L0_BITS = 8;
+    static const unsigned L1_BITS = 6;
+    static const uint64_t L0_SIZE = 1 << L0_BITS;
+    static const uint64_t L1_SIZE = 1 << L1_BITS;
+
+    // milliseconds per tick
+    static const unsigned TICK_MS = 100;
+
+    TimerWheel()
+        : d_now(clockTicks())
+    {
+        for (auto& s: d_level0)
+            s.next = s.prev = &s;
+        for (auto& s: d_level1)
+            s.next = s.prev = &s;
+    }
+
+    // no syscall, CLOCK_MONOTONIC_COARSE is served by the vdso
+    static uint64_t clockTicks()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+    }
+
+    uint64_t now() const
+    {
+        return d_now;
+    }
+
+    // (re)schedules the timer to fire in the given number of ticks
+    void schedule(TimerNode* n, uint64_t ticks)
+    {
+        n->unlink();
+        n->expires = d_now + (ticks ? ticks : 1);
+        insert(n);
+    }
+
+    // expires everything due by the current time
+    template <typename F>
+    void advance(F onExpire)
+    {
+        uint64_t target = clockTicks();
+
+        while (d_now < target) {
+            ++d_now;
+
+            size_t idx = d_now & (L0_SIZE - 1);
+            if (idx == 0)
+                cascade();
+
+            TimerNode& slot = d_level0[idx];
+            while (slot.next != &slot) {
+                TimerNode* n = slot.next;
+                n->unlink();
+                onExpire(n);
+            }
+        }
+    }
+
+private:
+
+    static void link(TimerNode& slot, TimerNode* n)
+    {
+        n->prev = slot.prev;
+        n->next = &slot;
+        slot.prev->next = n;
+        slot.prev = n;
+    }
+
+    void insert(TimerNode* n)
+    {
+        uint64_t delta = n->expires - d_now;
+
+        if (delta < L0_SIZE) {
+            link(d_level0[n->expires & (L0_SIZE - 1)], n);
+        } else if (delta < L0_SIZE * L1_SIZE) {
+            link(d_level1[(n->expires >> L0_BITS) & (L1_SIZE - 1)], n);
+        } else {
+            link(d_level1[((d_now >> L0_BITS) + L1_SIZE - 1) & (L1_SIZE - 1)], n);
+        }
+    }
+
+    // moves the level 1 slot of the coming turn down to level 0
+    void cascade()
+    {
+        TimerNode& slot = d_level1[(d_now >> L0_BITS) & (L1_SIZE - 1)];
+        TimerNode pending;
+        pending.next = pending.prev = &pending;
+
+        while (slot.next != &slot) {
+            TimerNode* n = slot.next;
+            n->unlink();
+            link(pending, n);
+        }
+
+        while (pending.next != &pending) {
+            TimerNode* n = pending.next;
+            n->unlink();
+            if (n->expires < d_now)
+                n->expires = d_now;
+            insert(n);
+        }
+
+        pending.next = pending.prev = nullptr;
+    }
+
+    uint64_t d_now;
+    TimerNode d_level0[L0_SIZE];
+    TimerNode d_level1[L1_SIZE];
+};
@@ -0,0 +1,200 @@
+#include "visit_filters.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// kernel tables are indexed by a bit per active check
+size_t markChecks(const MarkFilter& filter)
+{
+    bool age = filter.fromBirth != INT32_MIN || filter.toBirth != INT32_MAX;
+    return (filter.gender ? 1 : 0) | (age ? 2 : 0);
+}
+
+size_t placeChecks(const PlaceFilter& filter)
+{
+    return (filter.toDistance ? 1 : 0) | (filter.country ? 2 : 0);
+}
+
+template <bool Gender, bool Age>
+void sumMarksScalar(const uint8_t* marks, const char* genders, const int32_t* birthDates,
+        size_t count, const MarkFilter& filter, uint64_t& sum, uint64_t& passed)
+{
+    for (size_t i = 0; i < count; ++i) {
+        bool pass = (!Gender || genders[i] == filter.gender)
+            && (!Age || (birthDates[i] >= filter.fromBirth && birthDates[i] <= filter.toBirth));
+
+        sum += pass ? marks[i] : 0;
+        passed += pass;
+    }
+}
+
+template <bool Distance, bool Country>
+size_t selectPlacesScalar(const uint32_t* distances, const uint32_t* countries,
+        size_t count, const PlaceFilter& filter, uint8_t* selected)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bool pass = (!Distance || distances[i] < filter.toDistance)
+            && (!Country || countries[i] == filter.country);
+
+        selected[n] = i;
+        n += pass;
+    }
+    return n;
+}
+
+constexpr MarkKernel scalarMarkKernels[4] = {
+    sumMarksScalar<false, false>,
+    sumMarksScalar<true, false>,
+    sumMarksScalar<false, true>,
+    sumMarksScalar<true, true>,
+};
+
+constexpr PlaceKernel scalarPlaceKernels[4] = {
+    selectPlacesScalar<false, false>,
+    selectPlacesScalar<true, false>,
+    selectPlacesScalar<false, true>,
+    selectPlacesScalar<true, true>,
+};
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+uint64_t horizontalSum(__m256i v)
+{
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v);
+
+    uint64_t sum = 0;
+    for (auto lane: lanes)
+        sum += lane;
+    return sum;
+}
+
+template <bool Gender, bool Age>
+__attribute__((target("avx2")))
+void sumMarksAvx2(const uint8_t* marks, const char* genders, const int32_t* birthDates,
+        size_t count, const MarkFilter& filter, uint64_t& sum, uint64_t& passed)
+{
+    const __m256i fromBirth = _mm256_set1_epi32(filter.fromBirth);
+    const __m256i toBirth = _mm256_set1_epi32(filter.toBirth);
+    const __m256i gender = _mm256_set1_epi32(filter.gender);
+    const __m256i ones = _mm256_set1_epi32(-1);
+
+    __m256i sums = _mm256_setzero_si256();
+    __m256i counts = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(marks + i)));
+        __m256i accepted = ones;
+
+        if (Age) {
+            __m256i birth = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(birthDates + i));
+            __m256i rejected = _mm256_or_si256(
+                    _mm256_cmpgt_epi32(fromBirth, birth),
+                    _mm256_cmpgt_epi32(birth, toBirth));
+            accepted = _mm256_andnot_si256(rejected, accepted);
+        }
+
+        if (Gender) {
+            __m256i g = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(genders + i)));
+            accepted = _mm256_and_si256(accepted, _mm256_cmpeq_epi32(g, gender));
+        }
+
+        sums = _mm256_add_epi32(sums, _mm256_and_si256(accepted, m));
+        // accepted lanes are -1
+        counts = _mm256_sub_epi32(counts, accepted);
+    }
+
+    sum += horizontalSum(sums);
+    passed += horizontalSum(counts);
+
+    sumMarksScalar<Gender, Age>(marks + i, genders + i, birthDates + i, count - i, filter, sum, passed);
+}
+
+template <bool Distance, bool Country>
+__attribute__((target("avx2")))
+size_t selectPlacesAvx2(const uint32_t* distances, const uint32_t* countries,
+        size_t count, const PlaceFilter& filter, uint8_t* selected)
+{
+    // d < limit as d == min(d, limit - 1), there is no unsigned compare
+    const __m256i last = _mm256_set1_epi32(filter.toDistance - 1);
+    const __m256i country = _mm256_set1_epi32(filter.country);
+
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i passed = _mm256_set1_epi32(-1);
+
+        if (Distance) {
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(distances + i));
+            passed = _mm256_cmpeq_epi32(_mm256_min_epu32(d, last), d);
+        }
+
+        if (Country) {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(countries + i));
+            passed = _mm256_and_si256(passed, _mm256_cmpeq_epi32(c, country));
+        }
+
+        unsigned bits = _mm256_movemask_ps(_mm256_castsi256_ps(passed));
+        while (bits) {
+            selected[n++] = i + __builtin_ctz(bits);
+            bits &= bits - 1;
+        }
+    }
+
+    size_t tail = selectPlacesScalar<Distance, Country>(distances + i, countries + i, count - i, filter, selected + n);
+    for (size_t k = n; k < n + tail; ++k)
+        selected[k] += i;
+
+    return n + tail;
+}
+
+constexpr MarkKernel avx2MarkKernels[4] = {
+    sumMarksAvx2<false, false>,
+    sumMarksAvx2<true, false>,
+    sumMarksAvx2<false, true>,
+    sumMarksAvx2<true, true>,
+};
+
+// with no check every position is taken, the scalar loop does as well
+constexpr PlaceKernel avx2PlaceKernels[4] = {
+    selectPlacesScalar<false, false>,
+    selectPlacesAvx2<true, false>,
+    selectPlacesAvx2<false, true>,
+    selectPlacesAvx2<true, true>,
+};
+
+bool haveAvx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+#else
+
+constexpr const MarkKernel* avx2MarkKernels = scalarMarkKernels;
+constexpr const PlaceKernel* avx2PlaceKernels = scalarPlaceKernels;
+
+bool haveAvx2()
+{
+    return false;
+}
+
+#endif
+
+} // namespace
+
+MarkKernel markKernel(const MarkFilter& filter)
+{
+    return (haveAvx2() ? avx2MarkKernels : scalarMarkKernels)[markChecks(filter)];
+}
+
+PlaceKernel placeKernel(const PlaceFilter& filter)
+{
+    return (haveAvx2() ? avx2PlaceKernels : scalarPlaceKernels)[placeChecks(filter)];
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Filters over the columns of visit list chunks. A query picks its
+// kernel once: each is compiled for one combination of active checks,
+// in the widest instruction set the CPU supports.
+
+struct MarkFilter
+{
+    // 0 matches any gender
+    char gender = 0;
+
+    // inclusive range of birth_date, in seconds
+    int32_t fromBirth = INT32_MIN;
+    int32_t toBirth = INT32_MAX;
+};
+
+// adds marks of the visits passing the filter and their number
+typedef void (*MarkKernel)(const uint8_t* marks, const char* genders, const int32_t* birthDates,
+        size_t count, const MarkFilter& filter, uint64_t& sum, uint64_t& passed);
+
+MarkKernel markKernel(const MarkFilter& filter);
+
+struct PlaceFilter
+{
+    // 0 disables either check
+    uint32_t toDistance = 0;
+    uint32_t country = 0;
+};
+
+// writes positions of visits passing the filter, returns how many,
+// count must not exceed 256
+typedef size_t (*PlaceKernel)(const uint32_t* distances, const uint32_t* countries,
+        size_t count, const PlaceFilter& filter, uint8_t* selected);
+
+PlaceKernel placeKernel(const PlaceFilter& filter);
@@ -0,0 +1,132 @@
+#include "write_pipeline.h"
+
+#include <memory>
+#include <vector>
+
+#include "epoch.h"
+
+WritePipeline::WritePipeline(Database& db)
+    : d_db(db)
+{
+    d_thread = std::thread([this] { run(); });
+}
+
+WritePipeline::~WritePipeline()
+{
+    {
+        std::lock_guard<std::mutex> lk(d_mutex);
+        d_stop = true;
+    }
+
+    d_wakeup.notify_one();
+    d_thread.join();
+}
+
+void WritePipeline::submit(Mutation* m)
+{
+    if (!d_queue.push(m))
+        return;
+
+    // the writer may be about to sleep, the lock makes sure it sees the item
+    std::lock_guard<std::mutex> lk(d_mutex);
+    d_wakeup.notify_one();
+}
+
+void WritePipeline::run()
+{
+    while (true) {
+        Mutation* batch = d_queue.popAll();
+
+        if (!batch) {
+            std::unique_lock<std::mutex> lk(d_mutex);
+            d_wakeup.wait(lk, [this] { return d_stop || !d_queue.empty(); });
+
+            if (d_stop && d_queue.empty())
+                return;
+            continue;
+        }
+
+        apply(batch);
+    }
+}
+
+void WritePipeline::apply(Mutation* batch)
+{
+    EpochGuard guard;
+
+    std::vector<std::unique_ptr<Mutation>> creates;
+    std::vector<Visit> visits;
+
+    // runs of visit creates go in together, other mutations keep their order
+    auto flushCreates = [&] {
+        if (creates.empty())
+            return;
+
+        d_db.create(visits);
+        for (auto& m: creates)
+            m->completion->completeWrite(200);
+
+        creates.clear();
+        visits.clear();
+    };
+
+    while (batch) {
+        std::unique_ptr<Mutation> m(batch);
+        batch = batch->next;
+
+        if (m->create && m->entity == Handler::Entity::Visit) {
+            visits.push_back(m->visit);
+            creates.push_back(std::move(m));
+            continue;
+        }
+
+        flushCreates();
+        m->completion->completeWrite(applyOne(*m));
+    }
+
+    flushCreates();
+}
+
+int WritePipeline::applyOne(Mutation& m)
+{
+    if (m.create) {
+        switch (m.entity) {
+        case Handler::Entity::User:
+            d_db.create(m.user);
+            return 200;
+        case Handler::Entity::Location:
+            d_db.create(m.location);
+            return 200;
+        case Handler::Entity::Visit:
+            d_db.create(m.visit);
+            return 200;
+        default:
+            return 400;
+        }
+    }
+
+    Database::UpdateResult result = Database::UpdateResult::badData;
+
+    switch (m.entity) {
+    case Handler::Entity::User:
+        result = d_db.updateUser(m.id, m.update);
+        break;
+    case Handler::Entity::Location:
+        result = d_db.updateLocation(m.id, m.update);
+        break;
+    case Handler::Entity::Visit:
+        result = d_db.updateVisit(m.id, m.update);
+        break;
+    default:
+        return 400;
+    }
+
+    switch (result) {
+    case Database::UpdateResult::ok:
+        return 200;
+    case Database::UpdateResult::notFound:
+        return 404;
+    default:
+        return 400;
+    }
+}
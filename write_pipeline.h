@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <rapidjson/document.h>
+
+#include "database.h"
+#include "handler.h"
+#include "mpsc_queue.h"
+
+// Parsed POST waiting for the writer thread
+struct Mutation
+{
+    Handler::Entity entity = Handler::Entity::Unknown;
+
+    // create carries the loaded entity, update the id and the new fields
+    bool create = false;
+    User user;
+    Location location;
+    Visit visit;
+
+    uint32_t id = 0;
+    rapidjson::Document update;
+
+    WriteCompletion* completion = nullptr;
+    Mutation* next = nullptr;
+};
+
+// Applies mutations to the database on a single writer thread. Whatever
+// has queued up while a batch was applied forms the next batch, and
+// consecutive visit creates in a batch touch each visit list once.
+// Statuses are reported through the mutation's completion, on the
+// writer thread.
+class WritePipeline
+{
+public:
+
+    WritePipeline(Database& db);
+    ~WritePipeline();
+
+    void submit(Mutation* m);
+
+private:
+
+    void run();
+    void apply(Mutation* batch);
+    int applyOne(Mutation& m);
+
+    Database& d_db;
+    MpscQueue<Mutation> d_queue;
+
+    std::mutex d_mutex;
+    std::condition_variable d_wakeup;
+    bool d_stop = false;
+
+    std::thread d_thread;
+};
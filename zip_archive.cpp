@@ -0,0 +1,260 @@
+#include "zip_archive.h"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t LOCAL_HEADER = 0x04034b50;
+const uint32_t CENTRAL_HEADER = 0x02014b50;
+const uint32_t END_OF_DIRECTORY = 0x06054b50;
+
+const size_t LOCAL_HEADER_SIZE = 30;
+const size_t CENTRAL_HEADER_SIZE = 46;
+const size_t END_OF_DIRECTORY_SIZE = 22;
+const size_t MAX_COMMENT = 0xffff;
+
+const uint16_t STORED = 0;
+const uint16_t DEFLATED = 8;
+const uint16_t ENCRYPTED = 1;
+
+// zip fields are little endian
+uint16_t read16(const unsigned char* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+uint32_t read32(const unsigned char* p)
+{
+    return read16(p) | uint32_t(read16(p + 2)) << 16;
+}
+
+} // namespace
+
+ZipArchive::~ZipArchive()
+{
+    if (d_data)
+        munmap(const_cast<unsigned char*>(d_data), d_size);
+}
+
+bool ZipArchive::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror(path.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < off_t(END_OF_DIRECTORY_SIZE)) {
+        fprintf(stderr, "%s: not a zip archive\n", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    d_data = static_cast<const unsigned char*>(data);
+    d_size = st.st_size;
+
+    if (!readDirectory()) {
+        fprintf(stderr, "%s: broken or unsupported zip archive\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool ZipArchive::readDirectory()
+{
+    // the end record is followed by a comment of up to 64K
+    const unsigned char* end = nullptr;
+    size_t last = d_size - END_OF_DIRECTORY_SIZE;
+    size_t first = last > MAX_COMMENT ? last - MAX_COMMENT : 0;
+
+    for (size_t pos = last + 1; pos-- > first; ) {
+        if (read32(d_data + pos) == END_OF_DIRECTORY) {
+            end = d_data + pos;
+            break;
+        }
+    }
+
+    if (!end)
+        return false;
+
+    size_t entries = read16(end + 10);
+    size_t directorySize = read32(end + 12);
+    size_t directoryOffset = read32(end + 16);
+
+    // zip64 puts the real values elsewhere
+    if (entries == 0xffff || directoryOffset == 0xffffffff)
+        return false;
+
+    if (directoryOffset + directorySize > size_t(end - d_data))
+        return false;
+
+    const unsigned char* p = d_data + directoryOffset;
+    const unsigned char* directoryEnd = p + directorySize;
+
+    for (size_t i = 0; i < entries; ++i) {
+        if (p + CENTRAL_HEADER_SIZE > directoryEnd || read32(p) != CENTRAL_HEADER)
+            return false;
+
+        uint16_t flags = read16(p + 8);
+        size_t nameLength = read16(p + 28);
+        size_t extraLength = read16(p + 30);
+        size_t commentLength = read16(p + 32);
+        size_t localOffset = read32(p + 42);
+
+        if (p + CENTRAL_HEADER_SIZE + nameLength > directoryEnd)
+            return false;
+
+        Member member;
+        member.name.assign(reinterpret_cast<const char*>(p + CENTRAL_HEADER_SIZE), nameLength);
+        member.method = read16(p + 10);
+        member.crc = read32(p + 16);
+        member.compressedSize = read32(p + 20);
+        member.size = read32(p + 24);
+
+        // sizes in the local header may be left out, they are taken from
+        // the directory, but the name and extra field lengths may differ
+        const unsigned char* local = d_data + localOffset;
+        if (localOffset + LOCAL_HEADER_SIZE > d_size || read32(local) != LOCAL_HEADER)
+            return false;
+
+        size_t dataOffset = localOffset + LOCAL_HEADER_SIZE + read16(local + 26) + read16(local + 28);
+        if (dataOffset + member.compressedSize > d_size)
+            return false;
+
+        member.data = d_data + dataOffset;
+
+        // stored data is read by its size, which must be what was checked
+        if (member.method == STORED && member.size != member.compressedSize)
+            return false;
+
+        if (flags & ENCRYPTED)
+            member.method = 0xffff;
+
+        d_members.push_back(member);
+        p += CENTRAL_HEADER_SIZE + nameLength + extraLength + commentLength;
+    }
+
+    return true;
+}
+
+const ZipArchive::Member* ZipArchive::find(const std::string& name) const
+{
+    for (const auto& member: d_members) {
+        if (member.name == name)
+            return &member;
+    }
+    return nullptr;
+}
+
+bool ZipArchive::read(const Member& member, std::string& dest) const
+{
+    ZipMemberStream stream(member);
+
+    dest.clear();
+    dest.reserve(member.size);
+
+    // a short member fails the stream at its end
+    while (stream.Tell() < member.size) {
+        char c = stream.Take();
+        if (stream.failed())
+            return false;
+        dest.push_back(c);
+    }
+
+    return !stream.failed();
+}
+
+ZipMemberStream::ZipMemberStream(const ZipArchive::Member& member)
+    : d_member(member)
+{
+    if (member.method == DEFLATED) {
+        d_zstream = z_stream();
+        d_zstream.next_in = const_cast<unsigned char*>(member.data);
+        d_zstream.avail_in = member.compressedSize;
+
+        // raw deflate, zip has its own headers
+        d_inflating = inflateInit2(&d_zstream, -MAX_WBITS) == Z_OK;
+        d_failed = !d_inflating;
+        d_buffer.resize(BUFFER_SIZE);
+    } else if (member.method != STORED) {
+        d_failed = true;
+    }
+
+    d_done = d_failed;
+}
+
+ZipMemberStream::~ZipMemberStream()
+{
+    if (d_inflating)
+        inflateEnd(&d_zstream);
+}
+
+bool ZipMemberStream::fill()
+{
+    if (d_done)
+        return false;
+
+    d_offset += d_end - d_begin;
+    d_begin = d_pos = d_end;
+
+    if (d_member.method == STORED) {
+        d_done = true;
+
+        if (crc32(0, d_member.data, d_member.size) != d_member.crc) {
+            d_failed = true;
+            return false;
+        }
+
+        d_begin = d_pos = reinterpret_cast<const char*>(d_member.data);
+        d_end = d_begin + d_member.size;
+        return d_member.size != 0;
+    }
+
+    for (;;) {
+        unsigned char* out = reinterpret_cast<unsigned char*>(d_buffer.data());
+        d_zstream.next_out = out;
+        d_zstream.avail_out = d_buffer.size();
+
+        int rc = inflate(&d_zstream, Z_NO_FLUSH);
+        size_t produced = d_buffer.size() - d_zstream.avail_out;
+
+        // no progress with input left over is a truncated member
+        if (rc == Z_STREAM_END) {
+            d_done = true;
+        } else if (rc != Z_OK) {
+            d_done = d_failed = true;
+            return false;
+        }
+
+        d_crc = crc32(d_crc, out, produced);
+
+        if (d_done && (d_crc != d_member.crc || d_offset + produced != d_member.size)) {
+            d_failed = true;
+            return false;
+        }
+
+        if (produced) {
+            d_begin = d_pos = d_buffer.data();
+            d_end = d_begin + produced;
+            return true;
+        }
+
+        if (d_done)
+            return false;
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+// Read-only view of a zip file mapped into memory. Members are listed
+// from the central directory; stored and deflated members are
+// supported, zip64 archives are not.
+class ZipArchive
+{
+public:
+
+    struct Member
+    {
+        std::string name;
+        uint16_t method;
+        uint32_t crc;
+        // compressed data inside the mapping
+        const unsigned char* data;
+        size_t compressedSize;
+        size_t size;
+    };
+
+    ZipArchive() = default;
+    ~ZipArchive();
+
+    ZipArchive(const ZipArchive&) = delete;
+    ZipArchive& operator=(const ZipArchive&) = delete;
+
+    bool open(const std::string& path);
+
+    const std::vector<Member>& members() const
+    {
+        return d_members;
+    }
+
+    // nullptr if there is no such member
+    const Member* find(const std::string& name) const;
+
+    // whole member, for small ones
+    bool read(const Member& member, std::string& dest) const;
+
+private:
+
+    bool readDirectory();
+
+    const unsigned char* d_data = nullptr;
+    size_t d_size = 0;
+    std::vector<Member> d_members;
+};
+
+// Decompresses one member piece by piece as it is read, a rapidjson
+// input stream. Peek() and Take() return '\0' at the end of data and
+// on errors, failed() tells the two apart.
+class ZipMemberStream
+{
+public:
+
+    typedef char Ch;
+
+    explicit ZipMemberStream(const ZipArchive::Member& member);
+    ~ZipMemberStream();
+
+    ZipMemberStream(const ZipMemberStream&) = delete;
+    ZipMemberStream& operator=(const ZipMemberStream&) = delete;
+
+    Ch Peek()
+    {
+        return d_pos != d_end || fill() ? *d_pos : '\0';
+    }
+
+    Ch Take()
+    {
+        return d_pos != d_end || fill() ? *d_pos++ : '\0';
+    }
+
+    size_t Tell() const
+    {
+        return d_offset + (d_pos - d_begin);
+    }
+
+    bool failed() const
+    {
+        return d_failed;
+    }
+
+    // not an output stream, needed by the reader interface only
+    Ch* PutBegin() { return nullptr; }
+    void Put(Ch) {}
+    void Flush() {}
+    size_t PutEnd(Ch*) { return 0; }
+
+private:
+
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    // next piece of output, false at the end or on errors
+    bool fill();
+
+    const ZipArchive::Member& d_member;
+
+    z_stream d_zstream;
+    bool d_inflating = false;
+    bool d_done = false;
+    bool d_failed = false;
+    uint32_t d_crc = 0;
+
+    std::vector<char> d_buffer;
+    const char* d_begin = nullptr;
+    const char* d_pos = nullptr;
+    const char* d_end = nullptr;
+    // of d_begin in the member
+    size_t d_offset = 0;
+};